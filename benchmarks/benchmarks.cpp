@@ -0,0 +1,436 @@
+#include "../include/cpparseopt.h"
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+using namespace cpparseopt;
+
+
+// =============================== begin: Utils ===============================+
+// Heap usage counters. Each block is prefixed with its size.
+static size_t liveBytes = 0;
+static size_t allocations = 0;
+
+#if __cplusplus >= 201103L
+void *operator new(size_t size) {
+#else
+void *operator new(size_t size) throw(std::bad_alloc) {
+#endif
+    size_t *block = static_cast<size_t *>(std::malloc(size + 2 * sizeof(size_t)));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    block[0] = size;
+    liveBytes += size;
+    allocations++;
+    return block + 2;
+}
+
+void operator delete(void *ptr) throw() {
+    if (ptr) {
+        size_t *block = static_cast<size_t *>(ptr) - 2;
+        liveBytes -= block[0];
+        std::free(block);
+    }
+}
+
+template<typename T, size_t N>
+inline
+size_t sizeOfArray(const T(&)[N]) {
+    return N;
+}
+
+class Stopwatch {
+    std::clock_t start_;
+public:
+    Stopwatch() : start_(std::clock()) {}
+    double elapsedMs() const {
+        return 1000.0 * (std::clock() - start_) / CLOCKS_PER_SEC;
+    }
+};
+
+void report(const char *name, size_t iterations, const Stopwatch &watch) {
+    double ms = watch.elapsedMs();
+    std::cout << "    " << name << ": " << ms << " ms, "
+              << (ms * 1000000.0 / iterations) << " ns/iter" << std::endl;
+}
+// =============================== end of: Utils ===============================
+
+
+struct BenchConfig {
+    str_t input;
+    int threads;
+    long limit;
+    double ratio;
+    bool verbose;
+    bool quiet;
+
+    BenchConfig() : threads(0), limit(0), ratio(0),
+                    verbose(false), quiet(false) {}
+};
+
+void Bench__StructBinding() {
+    std::cout << "Struct binding vs manual glue" << std::endl;
+
+    const size_t iterations = 100000;
+    const char *argv[] = {"/path/to/bin", "file.txt", "--threads=8",
+                          "--limit", "1000", "-v"};
+    int argc = static_cast<int>(sizeOfArray(argv));
+
+    Pattern manual;
+    PatternBuilder(manual)
+            .arg("input")
+            .opt("--threads")
+            .opt("--limit")
+            .opt("--ratio").defaultVal("0.5")
+            .flag("-v")
+            .flag("-q");
+
+    Stopwatch manualWatch;
+    for (size_t i = 0; i < iterations; i++) {
+        CmdLineParams params = manual.match(argc, const_cast<char **>(argv));
+        BenchConfig config;
+        config.input = params.getArg("input").asString();
+        config.threads = params.getOpt("--threads").asInt();
+        config.limit = params.getOpt("--limit").asInt();
+        config.ratio = params.hasOpt("--ratio")
+                       ? params.getOpt("--ratio").asDouble() : 0.5;
+        config.verbose = params.hasFlag("-v");
+        config.quiet = params.hasFlag("-q");
+    }
+    report("manual glue", iterations, manualWatch);
+
+    PatternFor<BenchConfig> bound;
+    bound.arg("input", &BenchConfig::input);
+    bound.opt("--threads", &BenchConfig::threads);
+    bound.opt("--limit", &BenchConfig::limit);
+    bound.opt("--ratio", &BenchConfig::ratio).defaultVal("0.5");
+    bound.flag("-v", &BenchConfig::verbose);
+    bound.flag("-q", &BenchConfig::quiet);
+
+    Stopwatch boundWatch;
+    for (size_t i = 0; i < iterations; i++) {
+        BenchConfig config;
+        bound.match(argc, const_cast<char **>(argv), config);
+    }
+    report("PatternFor<T>", iterations, boundWatch);
+}
+
+
+str_t numbered(const char *prefix, size_t i) {
+    std::ostringstream out;
+    out << prefix << i;
+    return out.str();
+}
+
+void Bench__PatternFootprint() {
+    std::cout << "Pattern footprint" << std::endl;
+
+    const size_t count = 50000;
+    std::vector<str_t> names;
+    for (size_t i = 0; i < count; i++) {
+        names.push_back(numbered("--generated-option-", i));
+    }
+
+    size_t bytesBefore = liveBytes;
+    size_t allocationsBefore = allocations;
+    Stopwatch buildWatch;
+    Pattern pattern;
+    for (size_t i = 0; i < count; i++) {
+        PatternBuilder(pattern)
+                .opt(names[i])
+                .alias(numbered("--alias-", i))
+                .defaultVal("default value")
+                .descr("Description of a generated option");
+    }
+    report("build", count, buildWatch);
+    std::cout << "    memory: " << (liveBytes - bytesBefore) / count
+              << " bytes/param, "
+              << double(allocations - allocationsBefore) / count
+              << " allocations/param" << std::endl;
+    std::cout << "    records: Argument " << sizeof(Argument) << ", Flag "
+              << sizeof(Flag) << ", Option " << sizeof(Option)
+              << " bytes" << std::endl;
+
+    const size_t lookups = 500;
+    Stopwatch lookupWatch;
+    size_t found = 0;
+    for (size_t i = 0; i < lookups; i++) {
+        found += pattern.hasOpt(names[(i * 7919) % count]);
+    }
+    report("lookup", lookups, lookupWatch);
+    if (found != lookups) {
+        std::cout << "    lookup failed" << std::endl;
+    }
+}
+
+void Bench__Constraints() {
+    std::cout << "Constraints" << std::endl;
+
+    const size_t count = 400;
+    const size_t iterations = 20000;
+    std::vector<str_t> names;
+    for (size_t i = 0; i < count; i++) {
+        names.push_back(numbered("--flag-", i));
+    }
+    std::vector<const char *> argv(1, "/path/to/bin");
+    for (size_t i = 0; i < 10; i++) {
+        argv.push_back(names[i].c_str());
+        argv.push_back(names[100 + i].c_str());
+    }
+    int argc = static_cast<int>(argv.size());
+
+    Pattern plain;
+    for (size_t i = 0; i < count; i++) {
+        PatternBuilder(plain).flag(names[i]);
+    }
+    Pattern ruled(plain);
+    for (size_t i = 0; i < 100; i++) {
+        PatternBuilder(ruled)
+                .dependsOn(names[i], names[100 + i])
+                .conflicts(names[200 + i], names[300 + i])
+                .exclusive(names[i] + "|" + names[200 + i])
+                .atLeastOne(names[100 + i % 10] + "|" + names[300 + i]);
+    }
+
+    CmdLineParams params(plain);
+    Stopwatch plainWatch;
+    for (size_t i = 0; i < iterations; i++) {
+        plain.match(argc, const_cast<char **>(&argv[0]), params);
+    }
+    report("match, no rules", iterations, plainWatch);
+
+    CmdLineParams ruledParams(ruled);
+    Stopwatch ruledWatch;
+    for (size_t i = 0; i < iterations; i++) {
+        ruled.match(argc, const_cast<char **>(&argv[0]), ruledParams);
+    }
+    report("match, 400 rules", iterations, ruledWatch);
+}
+
+void Bench__TableConstruction() {
+    std::cout << "Table construction" << std::endl;
+
+    const size_t sizes[] = {1000, 10000, 100000};
+    for (size_t s = 0; s < sizeOfArray(sizes); s++) {
+        const size_t count = sizes[s];
+        // Options in 100 dotted namespaces, every 4th param is a flag.
+        std::vector<str_t> names;
+        std::vector<ParamDescr> table(count);
+        names.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            std::ostringstream name;
+            if (i % 4) {
+                name << "--service-" << (i * 7919) % 100 << ".option-" << i
+                     << "|--o" << i;
+                table[i].kind = ParamDescr::OptParam;
+                table[i].defaultVal = "default value";
+            } else {
+                name << "--flag-" << i;
+                table[i].kind = ParamDescr::FlagParam;
+                table[i].defaultVal = 0;
+            }
+            names.push_back(name.str());
+            table[i].names = names.back().c_str();
+            table[i].descr = "Description of a generated param";
+        }
+
+        Stopwatch tableWatch;
+        Pattern bulk;
+        PatternBuilder(bulk).table(&table[0], count);
+        std::cout << "    " << count << " params, ";
+        report("table", count, tableWatch);
+
+        Stopwatch fluentWatch;
+        Pattern fluent;
+        for (size_t i = 0; i < count; i++) {
+            str_t name = names[i].substr(0, names[i].find('|'));
+            if (ParamDescr::FlagParam == table[i].kind) {
+                PatternBuilder(fluent).flag(name).descr(table[i].descr);
+            } else {
+                PatternBuilder(fluent)
+                        .opt(name)
+                        .alias(names[i].substr(names[i].find('|') + 1))
+                        .defaultVal(table[i].defaultVal)
+                        .descr(table[i].descr);
+            }
+        }
+        std::cout << "    " << count << " params, ";
+        report("fluent", count, fluentWatch);
+    }
+}
+
+void Bench__MapOptions() {
+    std::cout << "Map options" << std::endl;
+
+    const size_t count = 500;
+    const size_t iterations = 2000;
+    std::vector<str_t> items;
+    std::vector<str_t> keys;
+    for (size_t i = 0; i < count; i++) {
+        keys.push_back(numbered("service.override.key-", i));
+        items.push_back(keys.back() + "=" + numbered("value-", i));
+    }
+    std::vector<const char *> argv(1, "/path/to/bin");
+    for (size_t i = 0; i < count; i++) {
+        argv.push_back("--set");
+        argv.push_back(items[i].c_str());
+    }
+    int argc = static_cast<int>(argv.size());
+
+    Pattern pattern;
+    PatternBuilder(pattern).opt("--set").map();
+
+    CmdLineParams params(pattern);
+    pattern.match(argc, const_cast<char **>(&argv[0]), params);
+    size_t allocationsBefore = allocations;
+    Stopwatch matchWatch;
+    for (size_t i = 0; i < iterations; i++) {
+        pattern.match(argc, const_cast<char **>(&argv[0]), params);
+    }
+    std::cout << "    " << count << " entries, ";
+    report("match", iterations, matchWatch);
+    std::cout << "    allocations/match: "
+              << (allocations - allocationsBefore) / iterations << std::endl;
+
+    // Downstream code used to scan the raw key=value strings.
+    size_t found = 0;
+    Stopwatch scanWatch;
+    for (size_t i = 0; i < iterations; i++) {
+        const str_t &key = keys[(i * 7919) % count];
+        for (size_t j = 0; j < count; j++) {
+            if (0 == items[j].compare(0, key.size(), key)
+                && '=' == items[j][key.size()]) {
+                found++;
+                break;
+            }
+        }
+    }
+    report("lookup, linear scan", iterations, scanWatch);
+
+    const ParamMap &map = params.getMap("--set");
+    Stopwatch findWatch;
+    for (size_t i = 0; i < iterations; i++) {
+        const str_t &key = keys[(i * 7919) % count];
+        found += 0 != map.find(key.data(), key.size());
+    }
+    report("lookup, map", iterations, findWatch);
+    if (found != 2 * iterations) {
+        std::cout << "    lookups failed" << std::endl;
+    }
+}
+
+void Bench__PluginExtension() {
+    std::cout << "Plugin extension" << std::endl;
+
+    // Each plugin adds its options to the live pattern and resolves them.
+    const size_t plugins = 200;
+    const size_t perPlugin = 50;
+    std::vector<str_t> names;
+    for (size_t p = 0; p < plugins; p++) {
+        for (size_t i = 0; i < perPlugin; i++) {
+            std::ostringstream name;
+            name << "--plugin-" << (p * 7919) % plugins << ".option-" << i;
+            names.push_back(name.str());
+        }
+    }
+
+    Pattern pattern;
+    PatternBuilder(pattern).flag("-v").opt("--config");
+    std::vector<OptHandle> handles;
+    double firstMs = 0;
+    double lastMs = 0;
+    Stopwatch totalWatch;
+    for (size_t p = 0; p < plugins; p++) {
+        Stopwatch pluginWatch;
+        for (size_t i = p * perPlugin; i < (p + 1) * perPlugin; i++) {
+            PatternBuilder(pattern).opt(names[i]).alias(names[i] + "-alias");
+            handles.push_back(pattern.getOptHandle(names[i]));
+        }
+        if (p < 20) {
+            firstMs += pluginWatch.elapsedMs();
+        } else if (p >= plugins - 20) {
+            lastMs += pluginWatch.elapsedMs();
+        }
+    }
+    report("all plugins, per option", plugins * perPlugin, totalWatch);
+    std::cout << "    first 20 plugins: " << firstMs * 1000000.0 /
+                 (20 * perPlugin) << " ns/option" << std::endl;
+    std::cout << "    last 20 plugins: " << lastMs * 1000000.0 /
+                 (20 * perPlugin) << " ns/option" << std::endl;
+
+    const size_t iterations = 2000;
+    const char *argv[] = {"/path/to/bin", "-v", "--config=/etc/host.conf",
+                          names[0].c_str(), "1", names[5000].c_str(), "2",
+                          names[9999].c_str(), "3"};
+    CmdLineParams params(pattern);
+    Stopwatch matchWatch;
+    for (size_t i = 0; i < iterations; i++) {
+        pattern.match(static_cast<int>(sizeOfArray(argv)),
+                      const_cast<char **>(argv), params);
+    }
+    report("match", iterations, matchWatch);
+    if (!params.has(handles[9999])) {
+        std::cout << "    match failed" << std::endl;
+    }
+}
+
+void Bench__MatchCopies() {
+    // Results returned by value and kept around, as a job runner does.
+    std::cout << "Match copies (C++" << (__cplusplus >= 201703L ? "17" :
+                                         __cplusplus >= 201103L ? "11" : "98")
+              << ")" << std::endl;
+
+    const size_t iterations = 20000;
+    const char *argv[] = {"/path/to/bin",
+                          "/var/spool/jobs/incoming/batch-000042.json",
+                          "/var/spool/jobs/outgoing/batch-000042.json",
+                          "--owner=analytics-pipeline-nightly",
+                          "--queue", "high-priority-reprocessing",
+                          "--mode", "incremental-with-checkpoints",
+                          "-v", "--",
+                          "/var/spool/jobs/extra/attachment-000001.bin"};
+    int argc = static_cast<int>(sizeOfArray(argv));
+
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("input").arg("output")
+            .opt("--owner").opt("--queue")
+            .opt("--mode").choices("full|incremental-with-checkpoints")
+            .flag("-v")
+            .rest("attachments");
+
+#ifdef CPPARSEOPT_STATS
+    Instrumentation::reset();
+#endif
+    size_t allocationsBefore = allocations;
+    Stopwatch watch;
+    std::vector<CmdLineParams> results;
+    for (size_t i = 0; i < iterations; i++) {
+        if (results.size() == 64) {
+            results.clear();
+        }
+        results.push_back(pattern.match(argc, const_cast<char **>(argv)));
+    }
+    report("match", iterations, watch);
+    std::cout << "    " << double(allocations - allocationsBefore) / iterations
+              << " allocations/match";
+#ifdef CPPARSEOPT_STATS
+    std::cout << ", " << double(Instrumentation::stats().copies) / iterations
+              << " copies/match";
+#endif
+    std::cout << std::endl;
+}
+
+
+int main() {
+    Bench__StructBinding();
+    Bench__PatternFootprint();
+    Bench__MatchCopies();
+    Bench__Constraints();
+    Bench__TableConstruction();
+    Bench__MapOptions();
+    Bench__PluginExtension();
+}
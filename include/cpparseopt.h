@@ -2,26 +2,76 @@
 #define CPPARSEOPT_CPPARSEOPT_H
 
 #include <map>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+#if __cplusplus >= 201103L
+#define CPPARSEOPT_MOVE
+#define CPPARSEOPT_NOEXCEPT noexcept
+#else
+#define CPPARSEOPT_NOEXCEPT
+#endif
+
 namespace cpparseopt {
     typedef std::string str_t;
 
+    class StringPool {
+        // Contiguous storage for names, descriptions and defaults of all
+        // params of a Pattern. Params refer to their strings by offset.
+        str_t data_;
+
+    public:
+        struct Ref {
+            unsigned int offset;
+            unsigned int length;
+        };
+
+        StringPool();
+
+        Ref add(const str_t &str);
+        Ref add(const char *str, size_t length);
+        // Lists are sequences of '\0'-terminated items. The list is moved to
+        // the end of the pool if something was added after it.
+        Ref addToList(const Ref &list, const str_t &item);
+        // New list of separator-delimited items, e.g. "-v|--verbose".
+        Ref addList(const char *items, char separator);
+        void reserve(size_t size);
+
+        str_t get(const Ref &ref) const;
+        const char *data(const Ref &ref) const;
+        size_t size() const;
+
+        static Ref emptyRef();
+    };
+
+
+    class Pattern;
+
     class ParamGeneric {
-        str_t descr_;
+        // Params are compact records without pointers: their strings are
+        // kept in the pool of the pattern and resolved through it, e.g. by
+        // Pattern::getName(). A copied pattern brings its own pool.
+        friend class Pattern;
+
+        StringPool::Ref descr_;
 
     protected:
-        std::vector<str_t> names_;
+        StringPool::Ref names_;
 
     public:
         ParamGeneric();
-        ParamGeneric(const str_t &name);
+        ParamGeneric(StringPool &pool, const str_t &name);
+        // Names already validated and added to the pool.
+        explicit ParamGeneric(const StringPool::Ref &names);
 
-        bool hasName(const str_t &name) const;
+        bool hasName(const StringPool &pool, const char *name,
+                     size_t length) const;
+        // The first name. Points into the pool, empty for anonymous args.
+        const char *getName(const StringPool &pool) const;
 
-        const str_t &getDescr() const;
-        void setDescr(const str_t &descr);
+        str_t getDescr(const StringPool &pool) const;
+        void setDescr(StringPool &pool, const str_t &descr);
 
     private:
         const str_t &ensureName(const str_t &name) const;
@@ -29,26 +79,133 @@ namespace cpparseopt {
 
 
     class ParamAliased : public ParamGeneric {
+        friend class Pattern;
+
+        // Number among all flags and options of the pattern. The bit of
+        // the param in constraint masks and its slot in the binding table.
+        size_t ordinal_;
     public:
-        ParamAliased(const str_t &name);
-        void addAlias(const str_t &alias);
-        const str_t &getCanonicalName() const;
+        ParamAliased(StringPool &pool, const str_t &name);
+        explicit ParamAliased(const StringPool::Ref &names);
+        void addAlias(StringPool &pool, const str_t &alias);
+        str_t getCanonicalName(const StringPool &pool) const;
+        size_t getOrdinal() const;
 
     private:
         const str_t &ensureName(const str_t &name) const;
     };
 
 
+    class ParamBinding {
+        // Typed pointer to a user variable. A bound value is converted
+        // during the match and stored into the variable once it succeeds.
+        // Struct field bindings only convert; the value is written by the
+        // setter table of PatternFor<T>.
+    public:
+        union Number {
+            int i;
+            long l;
+            unsigned int u;
+            unsigned long ul;
+            double d;
+            bool b;
+        };
+
+        struct Value {
+            // Value converted to the type of the bound variable.
+            Number num;
+            str_t str;
+        };
+
+    private:
+        void *target_;
+        bool field_;
+        void (*convert_)(const str_t &val, Value &dst);
+        void (*store_)(const Value &val, void *target);
+        void (*choose_)(int choice, Value &dst);
+
+    public:
+        ParamBinding();
+        ParamBinding(str_t *target);
+        ParamBinding(int *target);
+        ParamBinding(long *target);
+        ParamBinding(unsigned int *target);
+        ParamBinding(unsigned long *target);
+        ParamBinding(double *target);
+        ParamBinding(bool *target);
+
+        // Binding of a struct field of type M, see PatternFor<T>.
+        template<typename M>
+        static ParamBinding ofField();
+
+        bool isBound() const;
+        bool isField() const;
+        // Flags can be bound to bool variables only.
+        bool takesFlag() const;
+        bool takesString() const;
+        // Converts once, stores many times.
+        void convert(const str_t &val, Value &dst) const;
+        // Not for field bindings.
+        void store(const Value &val) const;
+        // Integer variables of choice options receive the choice id, e.g.
+        // to be cast to an enum; the others receive the value.
+        bool takesChoice() const;
+        void convertChoice(int choice, Value &dst) const;
+    };
+
+
+    class DefaultValue {
+        // Default value of an arg/option in any of the supported types.
+        // Kept converted to its declared type, next to the string form
+        // which is what the values from the command line look like.
+    public:
+        enum Type {
+            String,
+            Int,
+            Long,
+            UInt,
+            ULong,
+            Double,
+            Bool
+        };
+
+    private:
+        Type type_;
+        ParamBinding::Value value_;  // value_.str is the string form.
+    public:
+        DefaultValue();
+        DefaultValue(const char *val);
+        DefaultValue(const str_t &val);
+        // val is converted to the type right away, so a malformed default
+        // fails with BadValueException at pattern construction.
+        DefaultValue(Type type, const str_t &val);
+        DefaultValue(int val);
+        DefaultValue(long val);
+        DefaultValue(unsigned int val);
+        DefaultValue(unsigned long val);
+        DefaultValue(double val);
+        DefaultValue(bool val);
+
+        Type getType() const;
+        const str_t &str() const;
+        const ParamBinding::Value &getValue() const;
+    };
+
+
     class ParamValued {
-        str_t default_;
+        // The default as passed to the pattern, in its pool. The binding
+        // and the converted default are kept by the pattern, out of the
+        // param record.
+        friend class Pattern;
+
+        StringPool::Ref default_;
         bool hasDefault_;
 
     public:
         ParamValued();
 
-        const str_t &getDefault() const;
+        str_t getDefault(const StringPool &pool) const;
         bool hasDefault() const;
-        void setDefault(const str_t &val);
     };
 
 
@@ -56,8 +213,9 @@ namespace cpparseopt {
         // Just a positional argument. Can have human-readable name.
         size_t pos_;
     public:
-        Argument(size_t pos);
-        Argument(size_t pos, const str_t &name);
+        explicit Argument(size_t pos);
+        Argument(StringPool &pool, size_t pos, const str_t &name);
+        Argument(size_t pos, const StringPool::Ref &name);
         size_t getPos() const;
 
     private:
@@ -65,12 +223,72 @@ namespace cpparseopt {
     };
 
 
+    class RestArguments : public ParamGeneric {
+        // Variadic trailing positional arguments. Take all the positional
+        // params left after the fixed arguments and everything after "--".
+        size_t minCount_;
+        size_t maxCount_;
+    public:
+        RestArguments();
+        RestArguments(StringPool &pool, const str_t &name);
+
+        size_t getMinCount() const;
+        size_t getMaxCount() const;
+        void   setCount(size_t minCount, size_t maxCount);
+
+    private:
+        const str_t &ensureName(const str_t &name) const;
+    };
+
+
+    class ArgSpan {
+        // View of rest args: a range of argv, or of pointers into argv
+        // when options come between them. Owns nothing.
+        char **begin_;
+        size_t size_;
+    public:
+        ArgSpan();
+        ArgSpan(char **begin, size_t size);
+
+        size_t size() const;
+        bool   empty() const;
+        const char *operator[](size_t idx) const;
+        char *const *begin() const;
+        char *const *end() const;
+    };
+
+
     class Flag : public ParamAliased {
         // Boolean flag. Exists or not. Without value.
         // Examples:
         //      -f / --foo / -F / --FOO
     public:
-        Flag(const str_t &name);
+        Flag(StringPool &pool, const str_t &name);
+        explicit Flag(const StringPool::Ref &names);
+    };
+
+
+    class ChoiceTable {
+        // Perfect hash of the allowed values of an option to their ids.
+        // Ids follow the order of the values in the declaration.
+        struct Slot {
+            StringPool::Ref value;
+            int id;
+        };
+
+        std::vector<Slot> slots_;
+        unsigned int seed_;
+
+    public:
+        ChoiceTable();
+
+        bool empty() const;
+        void build(StringPool &pool, const std::vector<str_t> &values);
+        int  find(const StringPool &pool, const str_t &value) const;
+
+    private:
+        size_t slotOf(const str_t &value) const;
+        static unsigned int hash(const str_t &value, unsigned int seed);
     };
 
 
@@ -80,30 +298,237 @@ namespace cpparseopt {
         //      -f / --foo / -F / --FOO  (default value must be provided within the pattern!)
         //      --foo[=<fVal>]           (the way to override default value)
         //      -f <fVal> / --foo <fVal> (an opt without default value)
+        //      --mode=fast|safe         (one of the declared choices)
+        //      --set key=value          (a map option, may be repeated)
     public:
-        Option(const str_t &name);
+        // What a map option does with a key passed again.
+        enum DuplicateKeys {
+            LastWins,
+            FirstWins,
+            RejectDuplicates
+        };
+
+    private:
+        friend class Pattern;
+
+        // Number of the choice table among those of the pattern.
+        // npos - no choices.
+        size_t choiceSlot_;
+        // Number of the map among the map options of the pattern.
+        // npos - not a map.
+        size_t mapSlot_;
+        int defaultChoice_;
+        DuplicateKeys duplicateKeys_;
+    public:
+        Option(StringPool &pool, const str_t &name);
+        explicit Option(const StringPool::Ref &names);
+
+        bool hasChoices() const;
+        size_t getChoiceSlot() const;
+        int  getDefaultChoice() const;
+
+        // Maps have no choices, defaults and bindings.
+        bool isMap() const;
+        size_t getMapSlot() const;
+        DuplicateKeys getDuplicateKeys() const;
     };
 
 
     class CmdLineParams;
+    class CmdLineParamsParser;
+    class OptionRegistration;
     class PatternBuilder;
 
+    template<typename T>
+    class ParamHandle {
+        // Param resolved once within a pattern. CmdLineParams::get() reads
+        // its value by index, without any name lookups.
+        friend class Pattern;
+
+        size_t idx_;
+        explicit ParamHandle(size_t idx);
+    public:
+        size_t getIndex() const;
+    };
+
+    typedef ParamHandle<Argument> ArgHandle;
+    typedef ParamHandle<Flag>     FlagHandle;
+    typedef ParamHandle<Option>   OptHandle;
+
+
+    template<typename T>
+    class ParamList {
+        // Params of a pattern. They live in blocks of doubling sizes and
+        // are never moved, so references to them survive an extension of
+        // the pattern. Blocks are allocated once, items copied in place.
+        enum { FirstBlock = 8 };
+
+        std::vector<T *> blocks_;
+        size_t size_;
+    public:
+        ParamList();
+        ParamList(const ParamList &other);
+        ParamList &operator=(const ParamList &other);
+#ifdef CPPARSEOPT_MOVE
+        ParamList(ParamList &&other) noexcept;
+        ParamList &operator=(ParamList &&other) noexcept;
+#endif
+        ~ParamList();
+        void swap(ParamList &other) CPPARSEOPT_NOEXCEPT;
+
+        size_t   size() const;
+        bool     empty() const;
+        T       &operator[](size_t idx);
+        const T &operator[](size_t idx) const;
+        T       &back();
+        void     push_back(const T &param);
+        void     reserve(size_t size);
+        // O(log n): the param is looked for among the blocks.
+        size_t   indexOf(const T &param) const;
+
+    private:
+        size_t capacity() const;
+        void   destroy();
+        // Number of the block and the offset of the param within it.
+        static size_t blockOf(size_t idx, size_t &offset);
+    };
+
+
+    struct ParamDescr {
+        // Row of a static table of params, see PatternBuilder::table().
+        //
+        //     static const ParamDescr params[] = {
+        //         {ParamDescr::ArgParam,  "input", 0, "Input file"},
+        //         {ParamDescr::OptParam,  "-t|--threads", "4", "Workers"},
+        //         {ParamDescr::FlagParam, "-v|--verbose", 0, 0},
+        //     };
+        enum Kind {
+            ArgParam,
+            FlagParam,
+            OptParam
+        };
+        Kind kind;
+        const char *names;      // '|'-separated aliases. 0 - anonymous arg.
+        const char *defaultVal; // 0 - no default. Not used for flags.
+        const char *descr;      // May be 0.
+    };
+
+
     class Pattern {
     public:
-        typedef std::vector<Argument> Arguments;
-        typedef std::vector<Flag> Flags;
-        typedef std::vector<Option> Options;
+        typedef ParamList<Argument> Arguments;
+        typedef ParamList<Flag> Flags;
+        typedef ParamList<Option> Options;
+        // Indices of options of a namespace, ordered by the name.
+        typedef std::vector<unsigned int> NameIndex;
+        // Namespace ("--db.pool.") to its options. An option is listed
+        // under every namespace it belongs to.
+        typedef std::map<str_t, NameIndex> Namespaces;
+        // Presence of flags/options, one bit per param ordinal.
+        typedef unsigned long PresenceWord;
+        typedef std::vector<PresenceWord> Presence;
 
     private:
-        // Pattern is immutable. Can be constructed only through PatternBuilder.
+        // Pattern is immutable for matches. It is constructed and may later
+        // be extended (e.g. by plugins) only through PatternBuilder; params
+        // and handles obtained before an extension stay valid. Extensions
+        // must not run concurrently with matches.
         friend class PatternBuilder;
+        friend class CmdLineParams;
+        friend class CmdLineParamsParser;
+        friend class ParamGroup;
 
-        Arguments arguments_;
-        Flags     flags_;
-        Options   options_;
+        struct MaskWord {
+            size_t idx;
+            PresenceWord bits;
+        };
+
+        struct NameSlot {
+            unsigned int hash;
+            unsigned int idx;       // Param index + 1. 0 - empty slot.
+            ParamDescr::Kind kind;
+        };
+
+        struct Binding {
+            // Binding and typed default of a param. The string form of the
+            // default is kept in the pool only.
+            ParamBinding target;
+            // Default converted to the type of the target, if both are set.
+            // Is done as soon as both are, so a malformed default fails at
+            // pattern construction. String targets take the pool string.
+            ParamBinding::Number value;
+            // Default in its declared type, copied to the parsed params
+            // falling back to it.
+            DefaultValue::Type type;
+            ParamBinding::Number fallback;
+
+            Binding();
+        };
+        // Binding index + 1 by param, 0 - the param has no binding.
+        typedef std::vector<unsigned int> Slots;
+
+        struct Constraint {
+            // Compiled into a sparse mask over param ordinals: only non-zero
+            // words are kept, so a rule costs a word or two to check.
+            enum Kind {
+                Requires,       // Trigger present => all of the mask.
+                Conflicts,      // Trigger present => none of the mask.
+                Exclusive,      // At most one of the mask.
+                AtLeastOne      // At least one of the mask.
+            };
+            Kind kind;
+            size_t trigger;
+            size_t begin;       // Range of the mask in maskWords_.
+            size_t end;
+        };
+
+        StringPool    pool_;
+        Arguments     arguments_;
+        Flags         flags_;
+        Options       options_;
+        RestArguments rest_;
+        bool          hasRest_;
+        size_t        ordinals_;
+        size_t        mapCount_;
+        // Side tables of what most params don't have, so the param records
+        // stay small: bindings and typed defaults only for the params
+        // having them, found by argument position and by flag/option
+        // ordinal; choices by the choice slots of options.
+        Slots         argSlots_;
+        Slots         slots_;
+        std::vector<Binding> bindings_;
+        std::vector<ChoiceTable> choices_;
+        std::vector<MaskWord>   maskWords_;
+        std::vector<Constraint> constraints_;
+        Namespaces    namespaces_;
+        // Open-addressing hash of all names and aliases of named params.
+        std::vector<NameSlot> names_;
+        size_t        nameCount_;
+        // Registry head at the last PatternBuilder::registered() call.
+        const OptionRegistration *registered_;
     public:
+        Pattern();
+        Pattern(const Pattern &other);
+        Pattern &operator=(const Pattern &other);
+#ifdef CPPARSEOPT_MOVE
+        Pattern(Pattern &&other) noexcept;
+        Pattern &operator=(Pattern &&other) noexcept;
+#endif
+
         CmdLineParams match(int argc, char **argv) const;
         void          match(int argc, char **argv, CmdLineParams &dst) const;
+        // Matches a command string, e.g. "restart --timeout=30 'my svc'".
+        // The first token plays the role of argv[0]. The line is split in
+        // place into argv of the given capacity; both must outlive params.
+        CmdLineParams matchLine(char *line, char **argv,
+                                size_t capacity) const;
+        void          matchLine(char *line, char **argv, size_t capacity,
+                                CmdLineParams &dst) const;
+        // POSIX shell word splitting: blanks, '...', "...", backslash
+        // escapes and continuations; no expansions. Tokens are rewritten
+        // within the line and '\0'-terminated, nothing is allocated.
+        // Returns the number of tokens, stores at most capacity of them.
+        static size_t splitLine(char *line, char **argv, size_t capacity);
 
         // Next methods raise exceptions in case of unknown param name/pos.
         const Argument &getArg(size_t pos) const;
@@ -117,21 +542,150 @@ namespace cpparseopt {
         const Flag     &getFlag(const str_t &name) const;
         bool            hasFlag(const str_t &name) const;
 
+        const RestArguments &getRest() const;
+        bool                 hasRest() const;
+
+        // Strings of the params of this pattern, kept in its pool.
+        const char *getName(const ParamGeneric &param) const;
+        str_t       getDescr(const ParamGeneric &param) const;
+        str_t       getDefault(const ParamValued &param) const;
+        // Returns -1 if the value is not one of the option choices.
+        int         findChoice(const Option &option, const str_t &val) const;
+
+        // Handles are valid only for CmdLineParams of this pattern.
+        ArgHandle  getArgHandle(size_t pos) const;
+        ArgHandle  getArgHandle(const str_t &name) const;
+        OptHandle  getOptHandle(const str_t &name) const;
+        FlagHandle getFlagHandle(const str_t &name) const;
+
         str_t usage() const;
 
+    protected:
+        // Without dst only the bound variables receive the values.
+        // fields - parser to leave the values of struct field bindings in,
+        // for PatternFor<T>; 0 if there is no object to write them to.
+        void matchInto(int argc, char **argv, CmdLineParams *dst,
+                       CmdLineParamsParser *fields) const;
+        // Position of the next argument, ordinal of the next flag/option.
+        size_t argCount() const;
+        size_t ordinalCount() const;
+
     private:
         Argument &addArg();
         Argument &addArg(const str_t &name);
         Flag     &addFlag(const str_t &name);
         Option   &addOpt(const str_t &name);
+        RestArguments &addRest(const str_t &name);
+        void     addTable(const ParamDescr *params, size_t count);
+        void     addToNamespaces(unsigned int idx);
+        size_t   indexOf(const Flag &flag) const;
+        size_t   indexOf(const Option &option) const;
+        // The first param of the kind with the name, npos if none.
+        size_t   findName(ParamDescr::Kind kind, const char *name,
+                          size_t length) const;
+        void     indexName(ParamDescr::Kind kind, size_t idx,
+                           const char *name, size_t length);
+        // names - '\0'-terminated items, as in the pool.
+        void     indexNames(ParamDescr::Kind kind, size_t idx,
+                            const StringPool::Ref &names);
+        // Makes room for count more names.
+        void     growNames(size_t count);
+        const ParamGeneric &paramOf(ParamDescr::Kind kind, size_t idx) const;
+        // Gives the next flag/option ordinal its entry in the slot table.
+        size_t   nextOrdinal();
+        // 0 if the param has no binding.
+        Binding *findBinding(const Slots &slots, size_t idx);
+        const Binding *findBinding(const Slots &slots, size_t idx) const;
+        Binding &addBinding(Slots &slots, size_t idx);
         void     registerAlias(Flag &flag, const str_t &alias);
         void     registerAlias(Option &option, const str_t &alias);
+        void     registerMap(Option &option,
+                             Option::DuplicateKeys duplicates);
+        void     setDescr(ParamGeneric &param, const str_t &descr);
+        void     setDefault(Argument &arg, const DefaultValue &val);
+        void     setDefault(Option &option, const DefaultValue &val);
+        void     setBinding(Argument &arg, const ParamBinding &binding);
+        void     setBinding(Flag &flag, const ParamBinding &binding);
+        void     setBinding(Option &option, const ParamBinding &binding);
+        // Checks the default val against the choices and converts it for
+        // the binding. Returns the default choice, -1 if no choices.
+        int      convertDefault(const Option &option,
+                                const ParamBinding &binding, const str_t &val,
+                                ParamBinding::Value &dst) const;
+        // choices - '|'-separated values.
+        void     setChoices(Option &option, const str_t &choices);
+
+        // names - '|'-separated flags/options.
+        void     addConstraint(Constraint::Kind kind, const str_t &trigger,
+                               const str_t &names);
+        size_t   ordinalOf(const str_t &name) const;
+        const char *nameOf(size_t ordinal) const;
+        str_t    namesOf(const Constraint &constraint) const;
+        void     checkConstraints(const Presence &presence) const;
     };
 
 
+    class OptionRegistration {
+        // Node of the process-global list of statically registered flags
+        // and options. Nodes are static objects themselves, so registration
+        // neither allocates nor locks. Use CPPARSEOPT_OPT/CPPARSEOPT_FLAG.
+        const char *name_;
+        const char *descr_;
+        ParamBinding binding_;
+        bool isFlag_;
+        OptionRegistration *next_;
+
+        static OptionRegistration *head_;
+
+    public:
+        OptionRegistration(const char *name, const ParamBinding &binding,
+                           const char *descr);
+        OptionRegistration(const char *name, bool *target, const char *descr);
+
+        static const OptionRegistration *first();
+        const OptionRegistration *next() const;
+
+        const char *getName() const;
+        const char *getDescr() const;
+        const ParamBinding &getBinding() const;
+        bool isFlag() const;
+
+    private:
+        void link();
+    };
+
+    // Defines a variable bound to an option or a flag. The variable keeps
+    // its initial value unless the option/flag is matched. Registered params
+    // get into a pattern via PatternBuilder::registered().
+    //
+    //     CPPARSEOPT_OPT(int, threads, "--threads", 4, "Worker threads");
+    //     CPPARSEOPT_FLAG(verbose, "--verbose", "Verbose output");
+    //
+    // Other translation units can use CPPARSEOPT_DECLARE(int, threads).
+    // Threads reading a variable while a match may store into it use
+    // atomicLoad(threads); string variables must not be read meanwhile.
+#define CPPARSEOPT_OPT(type, var, name, initial, descr)                        \
+    type var = (initial);                                                      \
+    static ::cpparseopt::OptionRegistration var##_cpparseopt_registration(     \
+            (name), ::cpparseopt::ParamBinding(&var), (descr))
+
+#define CPPARSEOPT_FLAG(var, name, descr)                                      \
+    bool var = false;                                                          \
+    static ::cpparseopt::OptionRegistration var##_cpparseopt_registration(     \
+            (name), &var, (descr))
+
+#define CPPARSEOPT_DECLARE(type, var) extern type var
+
+    // Lock-free read of a scalar variable bound to a param. Matches store
+    // bound scalars atomically (with GCC-compatible compilers).
+    template<typename T>
+    T atomicLoad(const T &var);
+
+
     class ArgBuilder;
     class FlagBuilder;
     class OptBuilder;
+    class RestBuilder;
 
     class PatternBuilder {
         // Important! All classes in the Builder's hierarchy must not
@@ -146,10 +700,36 @@ namespace cpparseopt {
         ArgBuilder  arg(const str_t &name);
         FlagBuilder flag(const str_t &name);
         OptBuilder  opt(const str_t &name);
+        RestBuilder rest();
+        RestBuilder rest(const str_t &name);
+        // Adds all the flags/options registered so far with
+        // CPPARSEOPT_OPT/CPPARSEOPT_FLAG. Another call adds only those
+        // registered since the previous one (e.g. by loaded libraries).
+        PatternBuilder registered();
+        // Adds a whole table of params at once: all names are validated
+        // before anything is added, storage is reserved once.
+        PatternBuilder table(const ParamDescr *params, size_t count);
+        template<size_t N>
+        PatternBuilder table(const ParamDescr (&params)[N]);
+
+        // Constraints on presence of flags/options, checked by match().
+        // names - '|'-separated list of already added flags/options.
+        PatternBuilder dependsOn(const str_t &name, const str_t &names);
+        PatternBuilder conflicts(const str_t &name, const str_t &names);
+        PatternBuilder exclusive(const str_t &names);
+        PatternBuilder atLeastOne(const str_t &names);
 
     protected:
         void registerAlias(Flag &flag, const str_t &alias);
         void registerAlias(Option &option, const str_t &alias);
+        void registerMap(Option &option, Option::DuplicateKeys duplicates);
+        void setDescr(ParamGeneric &param, const str_t &descr);
+        void setDefault(Argument &arg, const DefaultValue &val);
+        void setDefault(Option &option, const DefaultValue &val);
+        void setBinding(Argument &arg, const ParamBinding &binding);
+        void setBinding(Flag &flag, const ParamBinding &binding);
+        void setBinding(Option &option, const ParamBinding &binding);
+        void setChoices(Option &option, const str_t &choices);
     };
 
 
@@ -160,7 +740,8 @@ namespace cpparseopt {
         Argument &arg_;
     public:
         ArgBuilder(Argument &arg, Pattern &pattern);
-        ArgDescrBuilder defaultVal(const str_t &val);
+        ArgBuilder bindTo(const ParamBinding &binding);
+        ArgDescrBuilder defaultVal(const DefaultValue &val);
         ArgValueBuilder descr(const str_t &descr);
     };
 
@@ -175,7 +756,16 @@ namespace cpparseopt {
         Argument &arg_;
     public:
         ArgValueBuilder(Argument &arg, Pattern &pattern);
-        PatternBuilder defaultVal(const str_t &val);
+        PatternBuilder defaultVal(const DefaultValue &val);
+    };
+
+
+    class RestBuilder : public PatternBuilder {
+        RestArguments &rest_;
+    public:
+        RestBuilder(RestArguments &rest, Pattern &pattern);
+        RestBuilder count(size_t minCount, size_t maxCount = str_t::npos);
+        RestBuilder descr(const str_t &descr);
     };
 
 
@@ -193,6 +783,8 @@ namespace cpparseopt {
     public:
         FlagBuilder(Flag &flag, Pattern &pattern);
         FlagBuilder alias(const str_t &alias);
+        FlagBuilder bindTo(bool *target);
+        FlagBuilder bindTo(const ParamBinding &binding);
         AliasBuilder<Flag> descr(const str_t &descr);
     };
 
@@ -205,7 +797,12 @@ namespace cpparseopt {
     public:
         OptBuilder(Option &option, Pattern &pattern);
         OptBuilder alias(const str_t &alias);
-        OptDescrBuilder defaultVal(const str_t &val);
+        OptBuilder bindTo(const ParamBinding &binding);
+        // choices - '|'-separated list of allowed values, e.g. "fast|safe".
+        OptBuilder choices(const str_t &choices);
+        // Each occurrence adds a key=value entry, e.g. "--set a=1 --set b=2".
+        OptBuilder map(Option::DuplicateKeys duplicates = Option::LastWins);
+        OptDescrBuilder defaultVal(const DefaultValue &val);
         OptValueBuilder descr(const str_t &descr);
     };
 
@@ -220,66 +817,258 @@ namespace cpparseopt {
         Option &option_;
     public:
         OptValueBuilder(Option &option, Pattern &pattern);
-        AliasBuilder<Option> defaultVal(const str_t &val);
+        AliasBuilder<Option> defaultVal(const DefaultValue &val);
     };
 
 
     class ParsedParam {
         // Value-object pattern.
-        const str_t val_;
+        friend class CmdLineParams;
+        friend class CmdLineParamsParser;
+
+        str_t val_;
+        int choice_;
+        // The typed default the value fell back to, String if none. Typed
+        // defaults are read without parsing.
+        DefaultValue::Type defaultType_;
+        ParamBinding::Number default_;
     public:
-        ParsedParam(const str_t &val = "");
+        ParsedParam(const str_t &val = "", int choice = -1);
         operator std::string() const;
         const str_t &asString() const;
-        // TODO:
-        // int          asInt() const;
-        // double       asDouble() const;
-        // asTime(), etc...
+        int          asInt() const;
+        double       asDouble() const;
+        // Id of the value within the option choices.
+        int          asChoice() const;
+        // TODO: asTime(), etc...
     };
 
 
     class ParsedArgParam : public ParsedParam {
-        const Argument &argument_;
+        const Argument *argument_;
     public:
-        ParsedArgParam(const Argument &argument, const str_t &val);
+        ParsedArgParam(const Argument &argument, const str_t &val = "");
         const Argument &getArg() const;
     };
 
 
+    class CmdLineParams;
+
+    class ParamGroup {
+        // Options of a dotted namespace, like "--db.pool.", in name order.
+        // A view into the params and their pattern.
+        const CmdLineParams *params_;
+        const unsigned int *begin_;
+        size_t size_;
+    public:
+        ParamGroup(const CmdLineParams &params, const unsigned int *begin,
+                   size_t size);
+
+        size_t size() const;
+        bool   empty() const;
+        const Option      &getOpt(size_t idx) const;
+        const char        *getName(size_t idx) const;
+        bool               has(size_t idx) const;
+        const ParsedParam &get(size_t idx) const;
+    };
+
+
     class CmdLineParamsParser;
 
-    class CmdLineParams {
+    class ParamMap {
+        // Entries of a map option in the order of the first occurrence of
+        // their keys. Keys and values point into argv, which is not
+        // modified. Keys are found through an open-addressing table of
+        // entry numbers with linear probing; storage grows geometrically
+        // and is reused by the next match into the same params.
+    public:
+        struct Entry {
+            const char *key;        // Not '\0'-terminated.
+            size_t keyLength;
+            const char *value;      // '\0'-terminated, the end of argv item.
+            size_t valueLength;
+        };
+
+        ParamMap();
+
+        size_t size() const;
+        bool   empty() const;
+        const Entry &operator[](size_t idx) const;
+        const Entry *begin() const;
+        const Entry *end() const;
+
+        // O(1). Returns 0 if there is no such key.
+        const Entry *find(const char *key, size_t length) const;
+        bool  has(const str_t &key) const;
+        // Raises MissingParamException if there is no such key.
+        str_t get(const str_t &key) const;
+
+    private:
+        friend class CmdLineParams;
         friend class CmdLineParamsParser;
 
-        struct ArgCmp {
-            bool operator()(const Argument &lhs, const Argument &rhs) const;
+        struct Slot {
+            unsigned int hash;
+            unsigned int entry;     // Entry number + 1. 0 - empty slot.
         };
-        typedef std::map<const Argument&, const ParsedArgParam, ArgCmp> ArgParams;
-        typedef ArgParams::value_type ArgParamsItem;
 
-        struct FlagCmp {
-            bool operator()(const Flag &lhs, const Flag &rhs) const;
-        };
-        typedef std::map<const Flag&, bool, FlagCmp> FlagParams;
-        typedef FlagParams::value_type FlagParamsItem;
+        std::vector<Entry> entries_;
+        std::vector<Slot> slots_;
 
-        const Pattern &pattern_;
+        void clear();
+        // Returns the entry of the key, a new one if inserted is set.
+        Entry &insert(const char *key, size_t length, bool &inserted);
+        size_t slotOf(const char *key, size_t length,
+                      unsigned int hash) const;
+        void grow();
+    };
+
+
+    class CmdLineParams {
+        friend class CmdLineParamsParser;
+        friend class ParamGroup;
+
+        // Parsed values are indexed the same way as params in the pattern.
+        typedef std::vector<ParsedArgParam> ArgParams;
+        typedef std::vector<bool> FlagParams;
+        typedef std::vector<ParsedParam> OptParams;
+        typedef std::vector<ParamMap> MapParams;
+
+        const Pattern *pattern_;
         ArgParams arguments_;
         FlagParams flags_;
-        // OptParams options_
+        OptParams options_;
+        std::vector<bool> passedOptions_;
+        // Indexed by the map slots of the options.
+        MapParams maps_;
+        ArgSpan rest_;
+        // Rest args of params loaded from a snapshot: '\0'-terminated items
+        // and the argv-like array of pointers to them. Matched rest args
+        // interleaved with options have only the pointers, into argv.
+        str_t restData_;
+        std::vector<char *> restArgv_;
+        // Map entries of params loaded from a snapshot, in the order of the
+        // maps and their entries: '\0'-terminated keys and values.
+        str_t mapData_;
     public:
         CmdLineParams(const Pattern &pattern);
+        CmdLineParams(const CmdLineParams &other);
+        CmdLineParams &operator=(const CmdLineParams &other);
+#ifdef CPPARSEOPT_MOVE
+        CmdLineParams(CmdLineParams &&other) noexcept;
+        CmdLineParams &operator=(CmdLineParams &&other) noexcept;
+#endif
+        void swap(CmdLineParams &other) CPPARSEOPT_NOEXCEPT;
 // На этом этапе нужно проверять только валидность имен/позиций для get*()-методов.
 // Значение (явно переданное или дефолтное) уже точно установлено во время
 // парсинга.
         const ParsedParam &getArg(const str_t &name) const;
         const ParsedParam &getArg(size_t pos) const;
         const ParsedParam &getOpt(const str_t &name) const;
+        bool hasOpt(const str_t &name) const;
         bool hasFlag(const str_t &name) const;
+
+        // Params added to the pattern after the match read as not passed,
+        // with empty values.
+        const ParsedParam &get(const ArgHandle &handle) const;
+        const ParsedParam &get(const OptHandle &handle) const;
+        bool               get(const FlagHandle &handle) const;
+        bool               has(const OptHandle &handle) const;
+        // Entries of a map option, empty if the option was not passed.
+        const ParamMap &getMap(const str_t &name) const;
+        const ParamMap &getMap(const OptHandle &handle) const;
+        // Points into argv passed to the match.
+        const ArgSpan &getRest() const;
         const Pattern &getPattern() const;
+        // Options under the namespace, e.g. "--db.pool" or "--db.pool.".
+        // O(log m), m is the number of namespaces. The group is valid until
+        // the pattern is extended.
+        ParamGroup group(const str_t &prefix) const;
+
+        // Snapshot of the effective values (passed and defaults) for audit
+        // logs and replay. Writers make a single pass and never allocate.
+        // They return the full snapshot size and write only what fits into
+        // the capacity, so a short buffer can be retried with the result.
+        size_t writeBinary(char *dst, size_t capacity) const;
+        // Not '\0'-terminated.
+        size_t writeJson(char *dst, size_t capacity) const;
+        // Restores values from writeBinary() output made with the same
+        // pattern. Bound variables are not touched. A truncated or
+        // corrupted snapshot raises an exception and changes nothing.
+        void readBinary(const char *src, size_t size);
+
+    private:
+        // Re-points loaded rest args and map entries to restData_ and
+        // mapData_, which don't keep their buffers on copies and swaps.
+        void rebindLoaded() CPPARSEOPT_NOEXCEPT;
     };
 
 
+#ifdef __GNUC__
+    class LiveParams {
+        // The latest CmdLineParams snapshot of a pattern, replaced with an
+        // atomic pointer swap on reload(). Readers only load the pointer.
+        // Old snapshots are reclaimed quiescent-state based (QSBR): after
+        // every registered reader has called quiescent() since the swap.
+        //
+        //     LiveParams live(pattern, argc, argv);
+        //     // Reader threads:
+        //     LiveParams::Reader reader(live);
+        //     for (;;) {
+        //         handle(request, reader.get().getOpt("--limit").asInt());
+        //         reader.quiescent();
+        //     }
+        //     // Control thread:
+        //     live.reload(newArgc, newArgv);
+        //
+        // reload() calls must not run concurrently with each other. Argv
+        // of a snapshot must outlive it (rest arguments point into it).
+    public:
+        enum { MaxReaders = 64 };
+
+        class Reader {
+            LiveParams &live_;
+            size_t slot_;
+        public:
+            explicit Reader(LiveParams &live);
+            ~Reader();
+            // The snapshot stays valid until the next quiescent() call.
+            const CmdLineParams &get() const;
+            // Reports that the reader holds no snapshot references.
+            void quiescent();
+
+        private:
+            Reader(const Reader &);
+            Reader &operator=(const Reader &);
+        };
+
+        LiveParams(const Pattern &pattern, int argc, char **argv);
+        ~LiveParams();
+
+        void   reload(int argc, char **argv);
+        size_t pending() const;
+
+    private:
+        struct Retired {
+            CmdLineParams *params;
+            unsigned long epoch;
+        };
+
+        const Pattern &pattern_;
+        CmdLineParams *current_;
+        unsigned long epoch_;
+        // 0 - free slot, otherwise the last epoch seen by the reader.
+        unsigned long readers_[MaxReaders];
+        std::vector<Retired> retired_;
+
+        void reclaim();
+
+        LiveParams(const LiveParams &);
+        LiveParams &operator=(const LiveParams &);
+    };
+#endif
+
+
     class CmdLineParamsParser {
         // Arg - pos, name, default val, description.
         //       Default is used only if argument is not present.
@@ -288,28 +1077,184 @@ namespace cpparseopt {
         // Opt - name, [alias, [alias, ...]], description.
         //       Default is used only if the option is present.
 
+        struct Token {
+            // argv item classified once before the parsing.
+            const char *str;
+            size_t length;
+            size_t nameLength;  // Length of the part before '='.
+            size_t dashes;      // Number of leading '-'.
+            bool hasValue;      // Contains '='.
+            bool validName;     // Part before '=' consists of name symbols.
+        };
+        typedef std::vector<Token> Tokens;
+
+        struct PendingStore {
+            // Value for a bound variable, stored once the match succeeds.
+            const ParamBinding *binding;
+            // Argument position or flag/option ordinal: the key of the
+            // setter of a struct field binding.
+            size_t slot;
+            bool arg;
+            ParamBinding::Value value;
+        };
+        typedef std::vector<PendingStore> PendingStores;
+
         int argc_;
         char **argv_;
         int paramCounter_;
+        Tokens tokens_;
+        bool optionsEnded_;
+        int restBegin_;
+        size_t restCount_;
+        bool restSplit_;  // Options between the rest args.
+        size_t argCount_;
+        const Pattern *pattern_;
         CmdLineParams *params_;
+        bool fields_;
+        Pattern::Presence presence_;
+        PendingStores stores_;
+        // Map entries of the matches without params, for the checks only.
+        CmdLineParams::MapParams maps_;
     public:
         CmdLineParamsParser();
-        void parse(int argc, char **argv, CmdLineParams &dst);
+        // dst may be 0: then only the bound variables are written.
+        // fields - keep the values of struct field bindings in the stores
+        // for PatternFor<T>, instead of rejecting them.
+        void parse(const Pattern &pattern, int argc, char **argv,
+                   CmdLineParams *dst, bool fields = false);
+
+    private:
+        const Token &currentParam();
+        bool         hasNextParam();
+        const Token &nextParam();
+
+        bool isFlagParam(const Token &param);
+        bool isOptParam(const Token &param);
+
+        void parseArg(const Token &param);
+        void parseFlag(const Token &param);
+        void parseOpt(const Token &param);
+        void parseMapEntry(size_t idx, const str_t &name, const Token &param);
+        void parseRest();
+        void markPresent(const ParamAliased &param);
+        // The slot for a value of the binding.
+        ParamBinding::Value &addStore(const ParamBinding &binding,
+                                      size_t slot, bool arg);
+        // A default converted by the pattern, val is its string form.
+        static void storeDefault(const Pattern::Binding &binding,
+                                 const str_t &val, ParamBinding::Value &dst);
+        // Copies the typed default of the binding, if any, to dst.
+        static void fallBack(const Pattern::Binding *binding,
+                             ParsedParam &dst);
+        void finish();
+
+        static void classify(const char *param, Token &dst);
+        void reset(const Pattern &pattern, int argc, char **argv,
+                   CmdLineParams *dst, bool fields);
+
+        template<typename T>
+        friend class PatternFor;
+    };
+
+
+    template<typename T>
+    class PatternFor : public Pattern {
+        // Pattern bound to the fields of T. Each param converts its value
+        // straight into the field of the object passed to match():
+        //
+        //     PatternFor<Config> pattern;
+        //     pattern.opt("--threads", &Config::threads).defaultVal("4");
+        //     pattern.flag("-v", &Config::verbose);
+        //     Config config;
+        //     pattern.match(argc, argv, config);
+
+        struct FieldSetter {
+            // Member pointer of one of the bindable types, applied with
+            // obj.*field; the type tells which one is set.
+            DefaultValue::Type type;
+            union {
+                str_t T::*str;
+                int T::*i;
+                long T::*l;
+                unsigned int T::*u;
+                unsigned long T::*ul;
+                double T::*d;
+                bool T::*b;
+            } field;
+
+            void set(str_t T::*member);
+            void set(int T::*member);
+            void set(long T::*member);
+            void set(unsigned int T::*member);
+            void set(unsigned long T::*member);
+            void set(double T::*member);
+            void set(bool T::*member);
+            void apply(const ParamBinding::Value &val, T &obj) const;
+        };
+        typedef std::vector<FieldSetter> FieldSetters;
+
+        // Setters by argument position and by flag/option ordinal. Slots
+        // of params without field bindings are never read.
+        FieldSetters argSetters_;
+        FieldSetters setters_;
+    public:
+        using Pattern::match;
+
+        template<typename M>
+        ArgBuilder  arg(const str_t &name, M T::*field);
+        template<typename M>
+        OptBuilder  opt(const str_t &name, M T::*field);
+        FlagBuilder flag(const str_t &name, bool T::*field);
+
+        void match(int argc, char **argv, T &dst) const;
 
     private:
-        const char *currentParam();
-        bool        hasNextParam();
-        const char *nextParam();
+        template<typename M>
+        static void addSetter(FieldSetters &setters, size_t slot,
+                              M T::*field);
+    };
+
+
+#ifdef CPPARSEOPT_STATS
+    // Instrumentation of the pattern construction and the parsing. Compiled
+    // in only with CPPARSEOPT_STATS defined (for the library and its users).
+    // Counters are global and not synchronized: they are meant for startup.
+    struct ParseStats {
+        unsigned long matches;
+        unsigned long tokens;       // argv items processed by the parser.
+        unsigned long lookups;      // Param searches by name.
+        unsigned long probes;       // Index slots visited by the searches.
+        unsigned long allocations;  // Parser buffer (re)allocations.
+        unsigned long exceptions;
+        unsigned long copies;       // Deep copies of Pattern and CmdLineParams.
+        // Wall time in nanoseconds. Nested phases count only once.
+        unsigned long buildNs;      // PatternBuilder calls.
+        unsigned long matchNs;      // Whole matches, including the below.
+        unsigned long classifyNs;
+        unsigned long lookupNs;
+        unsigned long convertNs;    // Choices and bound values.
+    };
 
-        bool isFlagParam(const char *param);
-        bool isOptParam(const char *param);
+    enum TracePhase {
+        PhaseBuild,
+        PhaseMatch,
+        PhaseClassify,
+        PhaseLookup,
+        PhaseConvert,
+        PhaseCount
+    };
 
-        void parseArg(const char *param);
-        void parseFlag(const char *param);
-        void parseOpt(const char *param);
+    class Instrumentation {
+    public:
+        // Called on the entry to / exit from the outermost phase scope.
+        typedef void (*TraceHook)(TracePhase phase, void *context);
 
-        void reset(int argc, char **argv, CmdLineParams &dst);
+        static ParseStats &stats();
+        static void reset();
+        static void setTraceHooks(TraceHook begin, TraceHook end,
+                                  void *context = 0);
     };
+#endif
 
 
     class Exception : public std::runtime_error {
@@ -334,6 +1279,176 @@ namespace cpparseopt {
         UnknownParamException(const std::string &msg,
                               const char *file, size_t line);
     };
+
+    class MissingParamException : public Exception {
+    public:
+        MissingParamException(const std::string &msg);
+        MissingParamException(const std::string &msg,
+                              const char *file, size_t line);
+    };
+
+    class BadValueException : public Exception {
+    public:
+        BadValueException(const std::string &msg);
+        BadValueException(const std::string &msg,
+                          const char *file, size_t line);
+    };
+
+    class ConflictingParamsException : public Exception {
+    public:
+        ConflictingParamsException(const std::string &msg);
+        ConflictingParamsException(const std::string &msg,
+                                   const char *file, size_t line);
+    };
+
+
+    template<typename M>
+    ParamBinding ParamBinding::ofField() {
+        ParamBinding binding(static_cast<M *>(0));
+        binding.field_ = true;
+        return binding;
+    }
+
+
+    template<typename T>
+    T atomicLoad(const T &var) {
+#ifdef __GNUC__
+        T result;
+        __atomic_load(const_cast<T *>(&var), &result, __ATOMIC_ACQUIRE);
+        return result;
+#else
+        return var;
+#endif
+    }
+
+
+    template<size_t N>
+    PatternBuilder PatternBuilder::table(const ParamDescr (&params)[N]) {
+        return table(params, N);
+    }
+
+
+    template<typename T>
+    void PatternFor<T>::FieldSetter::set(str_t T::*member) {
+        type = DefaultValue::String;
+        field.str = member;
+    }
+
+    template<typename T>
+    void PatternFor<T>::FieldSetter::set(int T::*member) {
+        type = DefaultValue::Int;
+        field.i = member;
+    }
+
+    template<typename T>
+    void PatternFor<T>::FieldSetter::set(long T::*member) {
+        type = DefaultValue::Long;
+        field.l = member;
+    }
+
+    template<typename T>
+    void PatternFor<T>::FieldSetter::set(unsigned int T::*member) {
+        type = DefaultValue::UInt;
+        field.u = member;
+    }
+
+    template<typename T>
+    void PatternFor<T>::FieldSetter::set(unsigned long T::*member) {
+        type = DefaultValue::ULong;
+        field.ul = member;
+    }
+
+    template<typename T>
+    void PatternFor<T>::FieldSetter::set(double T::*member) {
+        type = DefaultValue::Double;
+        field.d = member;
+    }
+
+    template<typename T>
+    void PatternFor<T>::FieldSetter::set(bool T::*member) {
+        type = DefaultValue::Bool;
+        field.b = member;
+    }
+
+    template<typename T>
+    void PatternFor<T>::FieldSetter::apply(const ParamBinding::Value &val,
+                                           T &obj) const {
+        switch (type) {
+            case DefaultValue::String:
+                obj.*field.str = val.str;
+                break;
+            case DefaultValue::Int:
+                obj.*field.i = val.num.i;
+                break;
+            case DefaultValue::Long:
+                obj.*field.l = val.num.l;
+                break;
+            case DefaultValue::UInt:
+                obj.*field.u = val.num.u;
+                break;
+            case DefaultValue::ULong:
+                obj.*field.ul = val.num.ul;
+                break;
+            case DefaultValue::Double:
+                obj.*field.d = val.num.d;
+                break;
+            case DefaultValue::Bool:
+                obj.*field.b = val.num.b;
+                break;
+        }
+    }
+
+    template<typename T>
+    template<typename M>
+    void PatternFor<T>::addSetter(FieldSetters &setters, size_t slot,
+                                  M T::*field) {
+        if (setters.size() <= slot) {
+            setters.resize(slot + 1);
+        }
+        setters[slot].set(field);
+    }
+
+    template<typename T>
+    template<typename M>
+    ArgBuilder PatternFor<T>::arg(const str_t &name, M T::*field) {
+        size_t pos = argCount();
+        ArgBuilder builder = PatternBuilder(*this).arg(name);
+        addSetter(argSetters_, pos, field);
+        return builder.bindTo(ParamBinding::ofField<M>());
+    }
+
+    template<typename T>
+    template<typename M>
+    OptBuilder PatternFor<T>::opt(const str_t &name, M T::*field) {
+        size_t ordinal = ordinalCount();
+        OptBuilder builder = PatternBuilder(*this).opt(name);
+        addSetter(setters_, ordinal, field);
+        return builder.bindTo(ParamBinding::ofField<M>());
+    }
+
+    template<typename T>
+    FlagBuilder PatternFor<T>::flag(const str_t &name, bool T::*field) {
+        size_t ordinal = ordinalCount();
+        FlagBuilder builder = PatternBuilder(*this).flag(name);
+        addSetter(setters_, ordinal, field);
+        return builder.bindTo(ParamBinding::ofField<bool>());
+    }
+
+    template<typename T>
+    void PatternFor<T>::match(int argc, char **argv, T &dst) const {
+        // The parser checks the whole match before leaving any value, so
+        // the object is written only by a successful one.
+        CmdLineParamsParser parser;
+        matchInto(argc, argv, 0, &parser);
+        for (size_t i = 0; i < parser.stores_.size(); i++) {
+            const CmdLineParamsParser::PendingStore &store = parser.stores_[i];
+            if (store.binding->isField()) {
+                const FieldSetters &setters = store.arg ? argSetters_
+                                                        : setters_;
+                setters[store.slot].apply(store.value, dst);
+            }
+        }
+    }
 }
 
 #endif //CPPARSEOPT_CPPARSEOPT_H
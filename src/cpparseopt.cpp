@@ -1,62 +1,471 @@
 #include "../include/cpparseopt.h"
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <utility>
+
+#ifdef CPPARSEOPT_MOVE
+#include <type_traits>
+#endif
+
+// CPPARSEOPT_NO_SIMD forces the portable scanner, e.g. to test it on x86.
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(CPPARSEOPT_NO_SIMD)
+#define _SSE2_SCAN
+#define _NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#include <emmintrin.h>
+#else
+#define _NO_SANITIZE_ADDRESS
+#endif
+
+#ifdef CPPARSEOPT_STATS
+#include <time.h>
+#define _STAT(field, n) (Instrumentation::stats().field += (n))
+#define _PHASE(phase, field) \
+    PhaseScope phaseScope((phase), Instrumentation::stats().field)
+#else
+#define _STAT(field, n) ((void)0)
+#define _PHASE(phase, field) ((void)0)
+#endif
 
 #ifdef _DEBUG
-#define _THROW(ET, msg) throw ET((msg), __FILE__, __LINE__)
+#define _THROW(ET, msg) \
+    (_STAT(exceptions, 1), throw ET((msg), __FILE__, __LINE__))
 #else
-#define _THROW(ET, msg) throw ET((msg))
+#define _THROW(ET, msg) (_STAT(exceptions, 1), throw ET((msg)))
 #endif
 
 using namespace cpparseopt;
 
+#ifdef CPPARSEOPT_MOVE
+// Containers move their items on growth only if the moves can't throw.
+static_assert(std::is_nothrow_move_constructible<Argument>::value &&
+              std::is_nothrow_move_constructible<Flag>::value &&
+              std::is_nothrow_move_constructible<Option>::value &&
+              std::is_nothrow_move_constructible<ParamBinding>::value &&
+              std::is_nothrow_move_constructible<ParsedArgParam>::value &&
+              std::is_nothrow_move_constructible<Pattern>::value &&
+              std::is_nothrow_move_constructible<CmdLineParams>::value,
+              "Params must be nothrow movable");
+#endif
+
+
+#ifdef CPPARSEOPT_STATS
+static ParseStats parseStats;
+static Instrumentation::TraceHook traceBegin = 0;
+static Instrumentation::TraceHook traceEnd = 0;
+static void *traceContext = 0;
+static int phaseDepth[PhaseCount];
+
+static unsigned long nowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long>(ts.tv_sec) * 1000000000ul + ts.tv_nsec;
+}
+
+class PhaseScope {
+    // Times the outermost scope of a phase and reports it to the hooks.
+    TracePhase phase_;
+    unsigned long &total_;
+    unsigned long start_;
+
+public:
+    PhaseScope(TracePhase phase, unsigned long &total)
+            : phase_(phase), total_(total), start_(0) {
+        if (0 == phaseDepth[phase_]++) {
+            if (traceBegin) {
+                traceBegin(phase_, traceContext);
+            }
+            start_ = nowNs();
+        }
+    }
+
+    ~PhaseScope() {
+        if (0 == --phaseDepth[phase_]) {
+            total_ += nowNs() - start_;
+            if (traceEnd) {
+                traceEnd(phase_, traceContext);
+            }
+        }
+    }
+};
+
+ParseStats &Instrumentation::stats() {
+    return parseStats;
+}
+
+void Instrumentation::reset() {
+    parseStats = ParseStats();
+}
+
+void Instrumentation::setTraceHooks(TraceHook begin, TraceHook end,
+                                    void *context) {
+    traceBegin = begin;
+    traceEnd = end;
+    traceContext = context;
+}
+#endif
+
+
+static str_t toString(size_t val) {
+    std::ostringstream out;
+    out << val;
+    return out.str();
+}
+
+static void convertValue(const str_t &val, str_t &dst) {
+    dst = val;
+}
+
+static void convertValue(const str_t &val, long &dst) {
+    char *end = 0;
+    errno = 0;
+    long result = std::strtol(val.c_str(), &end, 10);
+    if (val.empty() || *end != '\0' || errno == ERANGE) {
+        _THROW(BadValueException, "Bad integer value [" + val + "]");
+    }
+    dst = result;
+}
+
+static void convertValue(const str_t &val, int &dst) {
+    long result = 0;
+    convertValue(val, result);
+    if (result < INT_MIN || result > INT_MAX) {
+        _THROW(BadValueException, "Integer value [" + val + "] out of range");
+    }
+    dst = static_cast<int>(result);
+}
+
+static void convertValue(const str_t &val, unsigned long &dst) {
+    char *end = 0;
+    errno = 0;
+    unsigned long result = std::strtoul(val.c_str(), &end, 10);
+    if (val.empty() || '-' == val[0] || *end != '\0' || errno == ERANGE) {
+        _THROW(BadValueException, "Bad unsigned value [" + val + "]");
+    }
+    dst = result;
+}
+
+static void convertValue(const str_t &val, unsigned int &dst) {
+    unsigned long result = 0;
+    convertValue(val, result);
+    if (result > UINT_MAX) {
+        _THROW(BadValueException, "Unsigned value [" + val + "] out of range");
+    }
+    dst = static_cast<unsigned int>(result);
+}
+
+static void convertValue(const str_t &val, double &dst) {
+    char *end = 0;
+    errno = 0;
+    double result = std::strtod(val.c_str(), &end);
+    if (val.empty() || *end != '\0' || errno == ERANGE) {
+        _THROW(BadValueException, "Bad double value [" + val + "]");
+    }
+    dst = result;
+}
+
+static void convertValue(const str_t &val, bool &dst) {
+    if ("1" == val || "true" == val || "yes" == val || "on" == val) {
+        dst = true;
+    } else if ("0" == val || "false" == val || "no" == val || "off" == val) {
+        dst = false;
+    } else {
+        _THROW(BadValueException, "Bad boolean value [" + val + "]");
+    }
+}
+
+// Bound variables may be read by other threads during a match (see
+// atomicLoad()), so scalars are published with a single atomic store.
+template<typename T>
+static void publish(T *target, T val) {
+#ifdef __GNUC__
+    __atomic_store(target, &val, __ATOMIC_RELEASE);
+#else
+    *target = val;
+#endif
+}
+
+static void publish(str_t *target, const str_t &val) {
+    *target = val;
+}
+
+typedef ParamBinding::Value BoundValue;
+static str_t &valueOf(BoundValue &val, str_t *) { return val.str; }
+static int &valueOf(BoundValue &val, int *) { return val.num.i; }
+static long &valueOf(BoundValue &val, long *) { return val.num.l; }
+static unsigned int &valueOf(BoundValue &val, unsigned int *) {
+    return val.num.u;
+}
+static unsigned long &valueOf(BoundValue &val, unsigned long *) {
+    return val.num.ul;
+}
+static double &valueOf(BoundValue &val, double *) { return val.num.d; }
+static bool &valueOf(BoundValue &val, bool *) { return val.num.b; }
+
+template<typename T>
+static void convertBoundValue(const str_t &val, BoundValue &dst) {
+    convertValue(val, valueOf(dst, static_cast<T *>(0)));
+}
+
+template<typename T>
+static void storeBoundValue(const BoundValue &val, void *target) {
+    publish(static_cast<T *>(target),
+            valueOf(const_cast<BoundValue &>(val), static_cast<T *>(0)));
+}
+
+template<typename T>
+static void convertChoiceValue(int choice, BoundValue &dst) {
+    valueOf(dst, static_cast<T *>(0)) = static_cast<T>(choice);
+}
+
+
+class NameSymbols {
+    // Lookup table of symbols allowed in param names.
+    bool allowed_[256];
+
+    NameSymbols() {
+        std::fill(allowed_, allowed_ + 256, false);
+        for (int c = 'a'; c <= 'z'; c++) allowed_[c] = true;
+        for (int c = 'A'; c <= 'Z'; c++) allowed_[c] = true;
+        for (int c = '0'; c <= '9'; c++) allowed_[c] = true;
+        allowed_['-'] = true;
+        allowed_['_'] = true;
+        allowed_['.'] = true;
+    }
+
+public:
+    static const NameSymbols &instance() {
+        static const NameSymbols table;
+        return table;
+    }
+
+    bool operator[](char c) const {
+        return allowed_[static_cast<unsigned char>(c)];
+    }
+};
+
+
+#ifdef _SSE2_SCAN
+static __m128i inRange(__m128i chars, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(chars, _mm_set1_epi8(hi + 1)));
+}
+#endif
+
+_NO_SANITIZE_ADDRESS
+static void scanToken(const char *str, size_t &length, size_t &eqPos,
+                      size_t &badPos) {
+    // Single pass over the token: its length, position of the first '='
+    // and position of the first symbol not allowed in names.
+    eqPos = str_t::npos;
+    badPos = str_t::npos;
+#ifdef _SSE2_SCAN
+    // Aligned 16-byte loads never cross a page boundary, so reading past
+    // the terminating zero is safe.
+    size_t skip = reinterpret_cast<size_t>(str) & 15;
+    const char *chunk = str - skip;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i eq = _mm_set1_epi8('=');
+    const __m128i underscore = _mm_set1_epi8('_');
+    for (;; skip = 0, chunk += 16) {
+        __m128i chars =
+                _mm_load_si128(reinterpret_cast<const __m128i *>(chunk));
+        __m128i letters = _mm_or_si128(inRange(chars, 'a', 'z'),
+                                       inRange(chars, 'A', 'Z'));
+        // '-' and '.' are adjacent.
+        __m128i others = _mm_or_si128(inRange(chars, '-', '.'),
+                                      _mm_cmpeq_epi8(chars, underscore));
+        __m128i valid = _mm_or_si128(_mm_or_si128(letters, others),
+                                     inRange(chars, '0', '9'));
+
+        unsigned mask = (0xFFFFu << skip) & 0xFFFFu;
+        unsigned zeroBits =
+                _mm_movemask_epi8(_mm_cmpeq_epi8(chars, zero)) & mask;
+        unsigned eqBits = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, eq)) & mask;
+        unsigned badBits = ~_mm_movemask_epi8(valid) & mask;
+
+        // Wraps around in the first chunk, but bits below skip are masked.
+        size_t offset = static_cast<size_t>(chunk - str);
+        if (str_t::npos == eqPos && eqBits) {
+            eqPos = offset + __builtin_ctz(eqBits);
+        }
+        if (str_t::npos == badPos && badBits) {
+            badPos = offset + __builtin_ctz(badBits);
+        }
+        if (zeroBits) {
+            length = offset + __builtin_ctz(zeroBits);
+            break;
+        }
+    }
+    // Same results as the portable loop: nothing past the terminator.
+    if (eqPos > length) {
+        eqPos = str_t::npos;
+    }
+    if (badPos >= length) {
+        badPos = str_t::npos;
+    }
+#else
+    const NameSymbols &symbols = NameSymbols::instance();
+    for (length = 0; str[length]; length++) {
+        if (str_t::npos == eqPos && '=' == str[length]) {
+            eqPos = length;
+        }
+        if (str_t::npos == badPos && !symbols[str[length]]) {
+            badPos = length;
+        }
+    }
+#endif
+}
+
+
+StringPool::StringPool() {
+}
+
+StringPool::Ref StringPool::add(const str_t &str) {
+    Ref ref;
+    ref.offset = static_cast<unsigned int>(data_.size());
+    ref.length = static_cast<unsigned int>(str.size());
+    data_.append(str);
+    return ref;
+}
+
+StringPool::Ref StringPool::add(const char *str, size_t length) {
+    Ref ref;
+    ref.offset = static_cast<unsigned int>(data_.size());
+    ref.length = static_cast<unsigned int>(length);
+    data_.append(str, length);
+    return ref;
+}
+
+StringPool::Ref StringPool::addToList(const Ref &list, const str_t &item) {
+    Ref ref = list;
+    if (ref.offset + ref.length != data_.size()) {
+        ref.offset = static_cast<unsigned int>(data_.size());
+        data_.append(data_, list.offset, list.length);
+    }
+    data_.append(item).push_back('\0');
+    ref.length += static_cast<unsigned int>(item.size() + 1);
+    return ref;
+}
+
+StringPool::Ref StringPool::addList(const char *items, char separator) {
+    Ref ref;
+    ref.offset = static_cast<unsigned int>(data_.size());
+    for (; *items; ++items) {
+        data_.push_back(separator == *items ? '\0' : *items);
+    }
+    data_.push_back('\0');
+    ref.length = static_cast<unsigned int>(data_.size() - ref.offset);
+    return ref;
+}
+
+void StringPool::reserve(size_t size) {
+    data_.reserve(size);
+}
+
+str_t StringPool::get(const Ref &ref) const {
+    return data_.substr(ref.offset, ref.length);
+}
+
+const char *StringPool::data(const Ref &ref) const {
+    return data_.data() + ref.offset;
+}
+
+size_t StringPool::size() const {
+    return data_.size();
+}
+
+StringPool::Ref StringPool::emptyRef() {
+    Ref ref;
+    ref.offset = 0;
+    ref.length = 0;
+    return ref;
+}
+
+
+ParamGeneric::ParamGeneric()
+        : descr_(StringPool::emptyRef()), names_(StringPool::emptyRef()) {
+}
 
-ParamGeneric::ParamGeneric() {
+ParamGeneric::ParamGeneric(StringPool &pool, const str_t &name)
+        : descr_(StringPool::emptyRef()),
+          names_(pool.addToList(StringPool::emptyRef(), ensureName(name))) {
 }
 
-ParamGeneric::ParamGeneric(const str_t &name)
-        : names_(1, ensureName(name)) {
+ParamGeneric::ParamGeneric(const StringPool::Ref &names)
+        : descr_(StringPool::emptyRef()), names_(names) {
+}
+
+bool ParamGeneric::hasName(const StringPool &pool, const char *name,
+                           size_t length) const {
+    if (0 == length) {
+        return false;
+    }
+    // Walk through the '\0'-terminated names.
+    const char *it = pool.data(names_);
+    const char *end = it + names_.length;
+    while (it < end) {
+        size_t itLength = std::strlen(it);
+        if (itLength == length && 0 == std::memcmp(it, name, length)) {
+            return true;
+        }
+        it += itLength + 1;
+    }
+    return false;
 }
 
-bool ParamGeneric::hasName(const str_t &name) const {
-    return !name.empty()
-           && std::find(names_.begin(), names_.end(), name) != names_.end();
+const char *ParamGeneric::getName(const StringPool &pool) const {
+    return names_.length ? pool.data(names_) : "";
 }
 
-const str_t &ParamGeneric::getDescr() const {
-    return descr_;
+str_t ParamGeneric::getDescr(const StringPool &pool) const {
+    return pool.get(descr_);
 }
 
-void ParamGeneric::setDescr(const str_t &descr) {
-    descr_ = descr;
+void ParamGeneric::setDescr(StringPool &pool, const str_t &descr) {
+    descr_ = pool.add(descr);
 }
 
 const str_t &ParamGeneric::ensureName(const str_t &name) const {
     if (name.empty()) {
         _THROW(BadNameException, "Empty param name");
     }
-    const str_t allowedSymbols = "abcdefghigklmnopqrstuvwxyz"
-                                 "ABCDEFGHIGKLMNOPQRSTUVWXYZ"
-                                 "0123456789-_";
-    if (name.find_first_not_of(allowedSymbols) != str_t::npos) {
-        _THROW(BadNameException, "Bad param name [" + name + "]. "
-                                 "Forbidden symbols");
+    const NameSymbols &symbols = NameSymbols::instance();
+    for (str_t::const_iterator it = name.begin(); it != name.end(); ++it) {
+        if (!symbols[*it]) {
+            _THROW(BadNameException, "Bad param name [" + name + "]. "
+                                     "Forbidden symbols");
+        }
     }
     return name;
 }
 
 
-ParamAliased::ParamAliased(const str_t &name)
-        : ParamGeneric(ensureName(name)) {
+ParamAliased::ParamAliased(StringPool &pool, const str_t &name)
+        : ParamGeneric(pool, ensureName(name)), ordinal_(0) {
+}
+
+ParamAliased::ParamAliased(const StringPool::Ref &names)
+        : ParamGeneric(names), ordinal_(0) {
 }
 
-void ParamAliased::addAlias(const str_t &alias) {
+void ParamAliased::addAlias(StringPool &pool, const str_t &alias) {
     // TODO: check collision with other aliases
-    names_.push_back(ensureName(alias));
+    names_ = pool.addToList(names_, ensureName(alias));
 }
 
-const str_t &ParamAliased::getCanonicalName() const {
-    return names_.at(0);
+str_t ParamAliased::getCanonicalName(const StringPool &pool) const {
+    return str_t(pool.data(names_));
+}
+
+size_t ParamAliased::getOrdinal() const {
+    return ordinal_;
 }
 
 const str_t &ParamAliased::ensureName(const str_t &name) const {
@@ -81,32 +490,222 @@ const str_t &ParamAliased::ensureName(const str_t &name) const {
 }
 
 
+ParamBinding::ParamBinding()
+        : target_(0), field_(false), convert_(0), store_(0), choose_(0) {
+}
+
+ParamBinding::ParamBinding(str_t *target)
+        : target_(target), field_(false),
+          convert_(&convertBoundValue<str_t>),
+          store_(&storeBoundValue<str_t>), choose_(0) {
+}
+
+ParamBinding::ParamBinding(int *target)
+        : target_(target), field_(false),
+          convert_(&convertBoundValue<int>),
+          store_(&storeBoundValue<int>),
+          choose_(&convertChoiceValue<int>) {
+}
+
+ParamBinding::ParamBinding(long *target)
+        : target_(target), field_(false),
+          convert_(&convertBoundValue<long>),
+          store_(&storeBoundValue<long>),
+          choose_(&convertChoiceValue<long>) {
+}
+
+ParamBinding::ParamBinding(unsigned int *target)
+        : target_(target), field_(false),
+          convert_(&convertBoundValue<unsigned int>),
+          store_(&storeBoundValue<unsigned int>),
+          choose_(&convertChoiceValue<unsigned int>) {
+}
+
+ParamBinding::ParamBinding(unsigned long *target)
+        : target_(target), field_(false),
+          convert_(&convertBoundValue<unsigned long>),
+          store_(&storeBoundValue<unsigned long>),
+          choose_(&convertChoiceValue<unsigned long>) {
+}
+
+ParamBinding::ParamBinding(double *target)
+        : target_(target), field_(false),
+          convert_(&convertBoundValue<double>),
+          store_(&storeBoundValue<double>), choose_(0) {
+}
+
+ParamBinding::ParamBinding(bool *target)
+        : target_(target), field_(false),
+          convert_(&convertBoundValue<bool>),
+          store_(&storeBoundValue<bool>), choose_(0) {
+}
+
+bool ParamBinding::isField() const {
+    return field_;
+}
+
+bool ParamBinding::isBound() const {
+    return 0 != convert_ && (field_ || 0 != target_);
+}
+
+bool ParamBinding::takesFlag() const {
+    return &storeBoundValue<bool> == store_;
+}
+
+bool ParamBinding::takesString() const {
+    return &storeBoundValue<str_t> == store_;
+}
+
+void ParamBinding::convert(const str_t &val, Value &dst) const {
+    assert(isBound());
+    convert_(val, dst);
+}
+
+void ParamBinding::store(const Value &val) const {
+    assert(isBound() && !field_);
+    store_(val, target_);
+}
+
+bool ParamBinding::takesChoice() const {
+    return 0 != choose_;
+}
+
+void ParamBinding::convertChoice(int choice, Value &dst) const {
+    assert(takesChoice());
+    choose_(choice, dst);
+}
+
+
+template<typename T>
+static str_t formatValue(const T &val) {
+    std::ostringstream out;
+    out << val;
+    return out.str();
+}
+
+DefaultValue::DefaultValue()
+        : type_(String), value_() {
+}
+
+DefaultValue::DefaultValue(const char *val)
+        : type_(String), value_() {
+    value_.str = val;
+}
+
+DefaultValue::DefaultValue(const str_t &val)
+        : type_(String), value_() {
+    value_.str = val;
+}
+
+DefaultValue::DefaultValue(Type type, const str_t &val)
+        : type_(type), value_() {
+    switch (type) {
+        case String:
+            break;
+        case Int:
+            convertValue(val, value_.num.i);
+            break;
+        case Long:
+            convertValue(val, value_.num.l);
+            break;
+        case UInt:
+            convertValue(val, value_.num.u);
+            break;
+        case ULong:
+            convertValue(val, value_.num.ul);
+            break;
+        case Double:
+            convertValue(val, value_.num.d);
+            break;
+        case Bool:
+            convertValue(val, value_.num.b);
+            break;
+    }
+    value_.str = val;
+}
+
+DefaultValue::DefaultValue(int val)
+        : type_(Int), value_() {
+    value_.num.i = val;
+    value_.str = formatValue(val);
+}
+
+DefaultValue::DefaultValue(long val)
+        : type_(Long), value_() {
+    value_.num.l = val;
+    value_.str = formatValue(val);
+}
+
+DefaultValue::DefaultValue(unsigned int val)
+        : type_(UInt), value_() {
+    value_.num.u = val;
+    value_.str = formatValue(val);
+}
+
+DefaultValue::DefaultValue(unsigned long val)
+        : type_(ULong), value_() {
+    value_.num.ul = val;
+    value_.str = formatValue(val);
+}
+
+DefaultValue::DefaultValue(double val)
+        : type_(Double), value_() {
+    // Shortest of the two forms which converts back to the same value.
+    std::ostringstream out;
+    out.precision(15);
+    out << val;
+    if (std::strtod(out.str().c_str(), 0) != val) {
+        out.str("");
+        out.precision(17);
+        out << val;
+    }
+    value_.num.d = val;
+    value_.str = out.str();
+}
+
+DefaultValue::DefaultValue(bool val)
+        : type_(Bool), value_() {
+    value_.num.b = val;
+    value_.str = val ? "true" : "false";
+}
+
+DefaultValue::Type DefaultValue::getType() const {
+    return type_;
+}
+
+const str_t &DefaultValue::str() const {
+    return value_.str;
+}
+
+const ParamBinding::Value &DefaultValue::getValue() const {
+    return value_;
+}
+
+
 ParamValued::ParamValued()
-        : hasDefault_(false) {
+        : default_(StringPool::emptyRef()), hasDefault_(false) {
 }
 
-const str_t &ParamValued::getDefault() const {
+str_t ParamValued::getDefault(const StringPool &pool) const {
     assert(hasDefault());
-    return default_;
+    return pool.get(default_);
 }
 
 bool ParamValued::hasDefault() const {
     return hasDefault_;
 }
 
-void ParamValued::setDefault(const str_t &val) {
-    assert(!hasDefault());
-    default_ = val;
-    hasDefault_ = true;
-}
-
 
 Argument::Argument(size_t pos)
         : pos_(pos) {
 }
 
-Argument::Argument(size_t pos, const str_t &name)
-        : ParamGeneric(ensureName(name)), pos_(pos) {
+Argument::Argument(StringPool &pool, size_t pos, const str_t &name)
+        : ParamGeneric(pool, ensureName(name)), pos_(pos) {
+}
+
+Argument::Argument(size_t pos, const StringPool::Ref &name)
+        : ParamGeneric(name), pos_(pos) {
 }
 
 size_t Argument::getPos() const {
@@ -121,355 +720,2547 @@ const str_t &Argument::ensureName(const str_t &name) const {
 }
 
 
-Flag::Flag(const str_t &name)
-        : ParamAliased(name) {
+RestArguments::RestArguments()
+        : minCount_(0), maxCount_(str_t::npos) {
 }
 
-
-Option::Option(const str_t &name)
-        : ParamAliased(name) {
+RestArguments::RestArguments(StringPool &pool, const str_t &name)
+        : ParamGeneric(pool, ensureName(name)), minCount_(0),
+          maxCount_(str_t::npos) {
 }
 
+size_t RestArguments::getMinCount() const {
+    return minCount_;
+}
 
-CmdLineParams Pattern::match(int argc, char **argv) const {
-    CmdLineParams result(*this);
-    match(argc, argv, result);
-    return result;
+size_t RestArguments::getMaxCount() const {
+    return maxCount_;
 }
 
-void Pattern::match(int argc, char **argv, CmdLineParams &dst) const {
-    if (&dst.getPattern() != this) {
-        _THROW(Exception, "Different patterns");
+void RestArguments::setCount(size_t minCount, size_t maxCount) {
+    if (minCount > maxCount) {
+        _THROW(Exception, "Bad rest arguments count [" + toString(minCount)
+                          + ", " + toString(maxCount) + "]");
     }
-    CmdLineParamsParser parser;
-    parser.parse(argc, argv, dst);
+    minCount_ = minCount;
+    maxCount_ = maxCount;
 }
 
-const Argument &Pattern::getArg(size_t pos) const {
-    if (pos >= arguments_.size()) {
-        _THROW(UnknownParamException, "No argument at position "
-                                      "[" + std::to_string(pos) + "]");
+const str_t &RestArguments::ensureName(const str_t &name) const {
+    if (name.find('-') == 0) {
+        _THROW(BadNameException, "Bad argument name [" + name + "]");
     }
-    // TODO: try ... catch
-    return arguments_.at(pos);
+    return name;
 }
 
-bool Pattern::hasArg(size_t pos) const {
-    return pos < arguments_.size();
+
+OptionRegistration *OptionRegistration::head_ = 0;
+
+OptionRegistration::OptionRegistration(const char *name,
+                                       const ParamBinding &binding,
+                                       const char *descr)
+        : name_(name), descr_(descr), binding_(binding), isFlag_(false),
+          next_(0) {
+    link();
 }
 
-template<typename Container>
-class NameMatcher
-{
-    const str_t &name_;
-public:
-    static typename Container::const_iterator find(const Container &params,
-                                                   const str_t &name) {
-        return std::find_if(params.begin(),
-                            params.end(),
-                            NameMatcher(name));
-    }
+OptionRegistration::OptionRegistration(const char *name, bool *target,
+                                       const char *descr)
+        : name_(name), descr_(descr), binding_(target), isFlag_(true),
+          next_(0) {
+    link();
+}
 
-    NameMatcher(const str_t &name) : name_(name) {}
-    bool operator()(const typename Container::value_type &param) {
-        return param.hasName(name_);
-    }
-};
+const OptionRegistration *OptionRegistration::first() {
+#ifdef __GNUC__
+    return __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+#else
+    return head_;
+#endif
+}
 
-const Argument &Pattern::getArg(const str_t &name) const {
-    Arguments::const_iterator it = NameMatcher<Arguments>::find(arguments_, name);
-    if (it == arguments_.end()) {
-        _THROW(UnknownParamException, "No arguments with name [" + name + "]");
-    }
-    return *it;
+const OptionRegistration *OptionRegistration::next() const {
+    return next_;
 }
 
-bool Pattern::hasArg(const str_t &name) const {
-    return NameMatcher<Arguments>::find(arguments_, name) != arguments_.end();
+const char *OptionRegistration::getName() const {
+    return name_;
 }
 
-const Option &Pattern::getOpt(const str_t &name) const {
-    Options::const_iterator it = NameMatcher<Options>::find(options_, name);
-    if (it == options_.end()) {
-        _THROW(UnknownParamException, "No options with name [" + name + "]");
-    }
-    return *it;
+const char *OptionRegistration::getDescr() const {
+    return descr_ ? descr_ : "";
 }
 
+const ParamBinding &OptionRegistration::getBinding() const {
+    return binding_;
+}
 
-bool Pattern::hasOpt(const str_t &name) const {
-    return NameMatcher<Options>::find(options_, name) != options_.end();
+bool OptionRegistration::isFlag() const {
+    return isFlag_;
 }
 
-const Flag &Pattern::getFlag(const str_t &name) const {
-    Flags::const_iterator it = NameMatcher<Flags>::find(flags_, name);
-    if (it == flags_.end()) {
-        _THROW(UnknownParamException, "No flags with name [" + name + "]");
-    }
-    return *it;
+void OptionRegistration::link() {
+    // Lock-free push to the head of the list. Static initialization is
+    // usually single-threaded, but libraries loaded with dlopen() may
+    // register concurrently.
+#ifdef __GNUC__
+    do {
+        next_ = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+    } while (!__sync_bool_compare_and_swap(&head_, next_, this));
+#else
+    next_ = head_;
+    head_ = this;
+#endif
+}
+
+
+ArgSpan::ArgSpan()
+        : begin_(0), size_(0) {
+}
+
+ArgSpan::ArgSpan(char **begin, size_t size)
+        : begin_(begin), size_(size) {
 }
 
-bool Pattern::hasFlag(const str_t &name) const {
-    return NameMatcher<Flags>::find(flags_, name) != flags_.end();
+size_t ArgSpan::size() const {
+    return size_;
+}
+
+bool ArgSpan::empty() const {
+    return 0 == size_;
+}
+
+const char *ArgSpan::operator[](size_t idx) const {
+    assert(idx < size_);
+    return begin_[idx];
+}
+
+char *const *ArgSpan::begin() const {
+    return begin_;
+}
+
+char *const *ArgSpan::end() const {
+    return begin_ + size_;
+}
+
+
+Flag::Flag(StringPool &pool, const str_t &name)
+        : ParamAliased(pool, name) {
+}
+
+Flag::Flag(const StringPool::Ref &names)
+        : ParamAliased(names) {
+}
+
+
+static unsigned int hashBytes(const char *data, size_t length,
+                              unsigned int seed) {
+    // FNV-1a
+    unsigned int result = 2166136261u ^ (seed * 16777619u);
+    for (const char *end = data + length; data != end; ++data) {
+        result ^= static_cast<unsigned char>(*data);
+        result *= 16777619u;
+    }
+    return result ^ (result >> 15);
+}
+
+
+ChoiceTable::ChoiceTable()
+        : seed_(0) {
+}
+
+bool ChoiceTable::empty() const {
+    return slots_.empty();
+}
+
+void ChoiceTable::build(StringPool &pool, const std::vector<str_t> &values) {
+    for (size_t i = 0; i < values.size(); i++) {
+        if (std::find(values.begin(), values.begin() + i, values[i])
+            != values.begin() + i) {
+            _THROW(BadValueException, "Duplicate choice [" + values[i] + "]");
+        }
+    }
+
+    // Look for a seed without collisions. Each time the table gets too
+    // crowded for the seeds tried so far, its size is doubled.
+    size_t size = 1;
+    while (size < values.size()) {
+        size <<= 1;
+    }
+    for (;; size <<= 1) {
+        std::vector<bool> used(size);
+        for (seed_ = 0; seed_ < 64; seed_++) {
+            std::fill(used.begin(), used.end(), false);
+            size_t i = 0;
+            for (; i < values.size(); i++) {
+                size_t slot = hash(values[i], seed_) & (size - 1);
+                if (used[slot]) {
+                    break;
+                }
+                used[slot] = true;
+            }
+            if (i == values.size()) {
+                Slot empty = {StringPool::emptyRef(), -1};
+                slots_.assign(size, empty);
+                for (i = 0; i < values.size(); i++) {
+                    Slot &slot = slots_[slotOf(values[i])];
+                    slot.value = pool.add(values[i]);
+                    slot.id = static_cast<int>(i);
+                }
+                return;
+            }
+        }
+    }
+}
+
+int ChoiceTable::find(const StringPool &pool, const str_t &value) const {
+    if (slots_.empty()) {
+        return -1;
+    }
+    const Slot &slot = slots_[slotOf(value)];
+    if (slot.id < 0 || slot.value.length != value.size()
+        || 0 != value.compare(0, value.size(), pool.data(slot.value),
+                              slot.value.length)) {
+        return -1;
+    }
+    return slot.id;
+}
+
+size_t ChoiceTable::slotOf(const str_t &value) const {
+    return hash(value, seed_) & (slots_.size() - 1);
+}
+
+unsigned int ChoiceTable::hash(const str_t &value, unsigned int seed) {
+    return hashBytes(value.data(), value.size(), seed);
+}
+
+
+Option::Option(StringPool &pool, const str_t &name)
+        : ParamAliased(pool, name), choiceSlot_(str_t::npos),
+          mapSlot_(str_t::npos), defaultChoice_(-1), duplicateKeys_(LastWins) {
+}
+
+Option::Option(const StringPool::Ref &names)
+        : ParamAliased(names), choiceSlot_(str_t::npos),
+          mapSlot_(str_t::npos), defaultChoice_(-1), duplicateKeys_(LastWins) {
+}
+
+bool Option::hasChoices() const {
+    return str_t::npos != choiceSlot_;
+}
+
+size_t Option::getChoiceSlot() const {
+    assert(hasChoices());
+    return choiceSlot_;
+}
+
+int Option::getDefaultChoice() const {
+    return defaultChoice_;
+}
+
+bool Option::isMap() const {
+    return str_t::npos != mapSlot_;
+}
+
+size_t Option::getMapSlot() const {
+    assert(isMap());
+    return mapSlot_;
+}
+
+Option::DuplicateKeys Option::getDuplicateKeys() const {
+    return duplicateKeys_;
+}
+
+
+template<typename T>
+ParamHandle<T>::ParamHandle(size_t idx)
+        : idx_(idx) {
+}
+
+template<typename T>
+size_t ParamHandle<T>::getIndex() const {
+    return idx_;
+}
+
+template class ParamHandle<Argument>;
+template class ParamHandle<Flag>;
+template class ParamHandle<Option>;
+
+
+template<typename T>
+ParamList<T>::ParamList()
+        : size_(0) {
+}
+
+template<typename T>
+ParamList<T>::ParamList(const ParamList &other)
+        : size_(0) {
+    try {
+        reserve(other.size_);
+        for (size_t i = 0; i < other.size_; ++i) {
+            push_back(other[i]);
+        }
+    } catch (...) {
+        destroy();
+        throw;
+    }
+}
+
+template<typename T>
+ParamList<T> &ParamList<T>::operator=(const ParamList &other) {
+    ParamList(other).swap(*this);
+    return *this;
+}
+
+#ifdef CPPARSEOPT_MOVE
+template<typename T>
+ParamList<T>::ParamList(ParamList &&other) noexcept
+        : size_(0) {
+    swap(other);
+}
+
+template<typename T>
+ParamList<T> &ParamList<T>::operator=(ParamList &&other) noexcept {
+    swap(other);
+    return *this;
+}
+#endif
+
+template<typename T>
+ParamList<T>::~ParamList() {
+    destroy();
+}
+
+template<typename T>
+void ParamList<T>::swap(ParamList &other) CPPARSEOPT_NOEXCEPT {
+    blocks_.swap(other.blocks_);
+    std::swap(size_, other.size_);
+}
+
+template<typename T>
+size_t ParamList<T>::size() const {
+    return size_;
+}
+
+template<typename T>
+bool ParamList<T>::empty() const {
+    return 0 == size_;
+}
+
+template<typename T>
+T &ParamList<T>::operator[](size_t idx) {
+    assert(idx < size_);
+    size_t offset;
+    size_t block = blockOf(idx, offset);
+    return blocks_[block][offset];
+}
+
+template<typename T>
+const T &ParamList<T>::operator[](size_t idx) const {
+    assert(idx < size_);
+    size_t offset;
+    size_t block = blockOf(idx, offset);
+    return blocks_[block][offset];
+}
+
+template<typename T>
+T &ParamList<T>::back() {
+    return (*this)[size_ - 1];
+}
+
+template<typename T>
+void ParamList<T>::push_back(const T &param) {
+    reserve(size_ + 1);
+    size_t offset;
+    size_t block = blockOf(size_, offset);
+    new (blocks_[block] + offset) T(param);
+    ++size_;
+}
+
+template<typename T>
+void ParamList<T>::reserve(size_t size) {
+    while (capacity() < size) {
+        size_t length = static_cast<size_t>(FirstBlock) << blocks_.size();
+        blocks_.reserve(blocks_.size() + 1);
+        blocks_.push_back(static_cast<T *>(
+                ::operator new(length * sizeof(T))));
+    }
+}
+
+template<typename T>
+size_t ParamList<T>::indexOf(const T &param) const {
+    size_t first = 0;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        size_t length = static_cast<size_t>(FirstBlock) << i;
+        // Pointers into different blocks are compared through std::less.
+        std::less<const T *> less;
+        if (!less(&param, blocks_[i]) && less(&param, blocks_[i] + length)) {
+            return first + (&param - blocks_[i]);
+        }
+        first += length;
+    }
+    assert(false);
+    return str_t::npos;
+}
+
+template<typename T>
+size_t ParamList<T>::capacity() const {
+    // Blocks double: 8 + 16 + ... = 8 * (2^n - 1).
+    return static_cast<size_t>(FirstBlock)
+           * ((static_cast<size_t>(1) << blocks_.size()) - 1);
+}
+
+template<typename T>
+void ParamList<T>::destroy() {
+    for (size_t i = 0; i < size_; ++i) {
+        (*this)[i].~T();
+    }
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        ::operator delete(blocks_[i]);
+    }
+    blocks_.clear();
+    size_ = 0;
+}
+
+template<typename T>
+size_t ParamList<T>::blockOf(size_t idx, size_t &offset) {
+    // Block b starts at FirstBlock * (2^b - 1).
+    unsigned long n = static_cast<unsigned long>(idx / FirstBlock + 1);
+#ifdef __GNUC__
+    size_t block = sizeof(n) * CHAR_BIT - 1 - __builtin_clzl(n);
+#else
+    size_t block = 0;
+    while (n >>= 1) {
+        ++block;
+    }
+#endif
+    offset = idx - static_cast<size_t>(FirstBlock) * ((size_t(1) << block) - 1);
+    return block;
+}
+
+template class ParamList<Argument>;
+template class ParamList<Flag>;
+template class ParamList<Option>;
+
+
+Pattern::Binding::Binding() : type(DefaultValue::String) {
+    value.ul = 0;
+    fallback.ul = 0;
+}
+
+
+Pattern::Pattern()
+        : hasRest_(false), ordinals_(0), mapCount_(0), nameCount_(0),
+          registered_(0) {
+}
+
+Pattern::Pattern(const Pattern &other)
+        : pool_(other.pool_), arguments_(other.arguments_),
+          flags_(other.flags_), options_(other.options_), rest_(other.rest_),
+          hasRest_(other.hasRest_), ordinals_(other.ordinals_),
+          mapCount_(other.mapCount_), argSlots_(other.argSlots_),
+          slots_(other.slots_), bindings_(other.bindings_),
+          choices_(other.choices_),
+          maskWords_(other.maskWords_), constraints_(other.constraints_),
+          namespaces_(other.namespaces_), names_(other.names_),
+          nameCount_(other.nameCount_), registered_(other.registered_) {
+    _STAT(copies, 1);
+}
+
+Pattern &Pattern::operator=(const Pattern &other) {
+    if (this != &other) {
+        _STAT(copies, 1);
+        pool_ = other.pool_;
+        arguments_ = other.arguments_;
+        flags_ = other.flags_;
+        options_ = other.options_;
+        rest_ = other.rest_;
+        hasRest_ = other.hasRest_;
+        ordinals_ = other.ordinals_;
+        mapCount_ = other.mapCount_;
+        argSlots_ = other.argSlots_;
+        slots_ = other.slots_;
+        bindings_ = other.bindings_;
+        choices_ = other.choices_;
+        maskWords_ = other.maskWords_;
+        constraints_ = other.constraints_;
+        namespaces_ = other.namespaces_;
+        names_ = other.names_;
+        nameCount_ = other.nameCount_;
+        registered_ = other.registered_;
+    }
+    return *this;
+}
+
+#ifdef CPPARSEOPT_MOVE
+Pattern::Pattern(Pattern &&other) noexcept
+        : pool_(std::move(other.pool_)),
+          arguments_(std::move(other.arguments_)),
+          flags_(std::move(other.flags_)),
+          options_(std::move(other.options_)),
+          rest_(other.rest_), hasRest_(other.hasRest_),
+          ordinals_(other.ordinals_), mapCount_(other.mapCount_),
+          argSlots_(std::move(other.argSlots_)),
+          slots_(std::move(other.slots_)),
+          bindings_(std::move(other.bindings_)),
+          choices_(std::move(other.choices_)),
+          maskWords_(std::move(other.maskWords_)),
+          constraints_(std::move(other.constraints_)),
+          namespaces_(std::move(other.namespaces_)),
+          names_(std::move(other.names_)), nameCount_(other.nameCount_),
+          registered_(other.registered_) {
+    other.rest_ = RestArguments();
+    other.hasRest_ = false;
+    other.ordinals_ = 0;
+    other.mapCount_ = 0;
+    other.nameCount_ = 0;
+    other.registered_ = 0;
+}
+
+Pattern &Pattern::operator=(Pattern &&other) noexcept {
+    if (this != &other) {
+        pool_ = std::move(other.pool_);
+        arguments_ = std::move(other.arguments_);
+        flags_ = std::move(other.flags_);
+        options_ = std::move(other.options_);
+        rest_ = other.rest_;
+        hasRest_ = other.hasRest_;
+        ordinals_ = other.ordinals_;
+        mapCount_ = other.mapCount_;
+        argSlots_ = std::move(other.argSlots_);
+        slots_ = std::move(other.slots_);
+        bindings_ = std::move(other.bindings_);
+        choices_ = std::move(other.choices_);
+        maskWords_ = std::move(other.maskWords_);
+        constraints_ = std::move(other.constraints_);
+        namespaces_ = std::move(other.namespaces_);
+        names_ = std::move(other.names_);
+        nameCount_ = other.nameCount_;
+        registered_ = other.registered_;
+        other.rest_ = RestArguments();
+        other.hasRest_ = false;
+        other.ordinals_ = 0;
+        other.mapCount_ = 0;
+        other.nameCount_ = 0;
+        other.registered_ = 0;
+    }
+    return *this;
+}
+#endif
+
+CmdLineParams Pattern::match(int argc, char **argv) const {
+    CmdLineParams result(*this);
+    match(argc, argv, result);
+    return result;
+}
+
+void Pattern::match(int argc, char **argv, CmdLineParams &dst) const {
+    matchInto(argc, argv, &dst, 0);
+}
+
+CmdLineParams Pattern::matchLine(char *line, char **argv,
+                                 size_t capacity) const {
+    CmdLineParams result(*this);
+    matchLine(line, argv, capacity, result);
+    return result;
+}
+
+void Pattern::matchLine(char *line, char **argv, size_t capacity,
+                        CmdLineParams &dst) const {
+    size_t count = splitLine(line, argv, capacity);
+    if (count > capacity) {
+        _THROW(Exception, "Too many tokens in the line, at most "
+                          "[" + toString(capacity) + "] expected");
+    }
+    matchInto(static_cast<int>(count), argv, &dst, 0);
+}
+
+static bool isBlank(char c) {
+    return ' ' == c || '\t' == c || '\n' == c;
+}
+
+size_t Pattern::splitLine(char *line, char **argv, size_t capacity) {
+    // Tokens are written over the line: every written char consumes at
+    // least one read char, so out never passes in.
+    const char *in = line;
+    char *out = line;
+    size_t count = 0;
+    for (;;) {
+        while (isBlank(*in)) {
+            ++in;
+        }
+        if ('\0' == *in) {
+            break;
+        }
+
+        char *token = out;
+        bool quoted = false;
+        while ('\0' != *in && !isBlank(*in)) {
+            char c = *in++;
+            if ('\\' == c) {
+                // Escaped char or continuation. Trailing '\' is dropped.
+                if ('\n' == *in) {
+                    ++in;
+                } else if ('\0' != *in) {
+                    *out++ = *in++;
+                }
+            } else if ('\'' == c) {
+                quoted = true;
+                for (; '\'' != *in; *out++ = *in++) {
+                    if ('\0' == *in) {
+                        _THROW(BadValueException, "Unterminated ' quote");
+                    }
+                }
+                ++in;
+            } else if ('"' == c) {
+                // Backslash escapes only $ ` " \ and newline here.
+                quoted = true;
+                while ('"' != *in) {
+                    if ('\0' == *in) {
+                        _THROW(BadValueException, "Unterminated \" quote");
+                    }
+                    if ('\\' == *in && '\0' != in[1]
+                        && std::strchr("$`\"\\\n", in[1])) {
+                        if ('\n' == *++in) {
+                            ++in;
+                            continue;
+                        }
+                    }
+                    *out++ = *in++;
+                }
+                ++in;
+            } else {
+                *out++ = c;
+            }
+        }
+        if (out == token && !quoted) {
+            // Only continuations, not a token.
+            continue;
+        }
+
+        bool last = '\0' == *in;
+        if (!last) {
+            ++in;
+        }
+        *out++ = '\0';
+        if (count < capacity) {
+            argv[count] = token;
+        }
+        ++count;
+        if (last) {
+            break;
+        }
+    }
+    return count;
+}
+
+void Pattern::matchInto(int argc, char **argv, CmdLineParams *dst,
+                        CmdLineParamsParser *fields) const {
+    _PHASE(PhaseMatch, matchNs);
+    _STAT(matches, 1);
+    if (dst && &dst->getPattern() != this) {
+        _THROW(Exception, "Different patterns");
+    }
+    if (fields) {
+        fields->parse(*this, argc, argv, dst, true);
+    } else {
+        CmdLineParamsParser parser;
+        parser.parse(*this, argc, argv, dst);
+    }
+}
+
+size_t Pattern::argCount() const {
+    return arguments_.size();
+}
+
+size_t Pattern::ordinalCount() const {
+    return ordinals_;
+}
+
+const Argument &Pattern::getArg(size_t pos) const {
+    if (pos >= arguments_.size()) {
+        _THROW(UnknownParamException, "No argument at position "
+                                      "[" + toString(pos) + "]");
+    }
+    return arguments_[pos];
+}
+
+bool Pattern::hasArg(size_t pos) const {
+    return pos < arguments_.size();
+}
+
+const Argument &Pattern::getArg(const str_t &name) const {
+    size_t idx = findName(ParamDescr::ArgParam, name.data(), name.size());
+    if (str_t::npos == idx) {
+        _THROW(UnknownParamException, "No arguments with name [" + name + "]");
+    }
+    return arguments_[idx];
+}
+
+bool Pattern::hasArg(const str_t &name) const {
+    return str_t::npos != findName(ParamDescr::ArgParam, name.data(),
+                                   name.size());
+}
+
+const Option &Pattern::getOpt(const str_t &name) const {
+    return options_[getOptHandle(name).getIndex()];
+}
+
+bool Pattern::hasOpt(const str_t &name) const {
+    return str_t::npos != findName(ParamDescr::OptParam, name.data(),
+                                   name.size());
+}
+
+const Flag &Pattern::getFlag(const str_t &name) const {
+    return flags_[getFlagHandle(name).getIndex()];
+}
+
+bool Pattern::hasFlag(const str_t &name) const {
+    return str_t::npos != findName(ParamDescr::FlagParam, name.data(),
+                                   name.size());
+}
+
+const RestArguments &Pattern::getRest() const {
+    if (!hasRest_) {
+        _THROW(UnknownParamException, "No rest arguments");
+    }
+    return rest_;
+}
+
+bool Pattern::hasRest() const {
+    return hasRest_;
+}
+
+const char *Pattern::getName(const ParamGeneric &param) const {
+    return param.getName(pool_);
+}
+
+str_t Pattern::getDescr(const ParamGeneric &param) const {
+    return param.getDescr(pool_);
+}
+
+str_t Pattern::getDefault(const ParamValued &param) const {
+    return param.getDefault(pool_);
+}
+
+ArgHandle Pattern::getArgHandle(size_t pos) const {
+    return ArgHandle(getArg(pos).getPos());
+}
+
+ArgHandle Pattern::getArgHandle(const str_t &name) const {
+    return ArgHandle(getArg(name).getPos());
+}
+
+OptHandle Pattern::getOptHandle(const str_t &name) const {
+    size_t idx = findName(ParamDescr::OptParam, name.data(), name.size());
+    if (str_t::npos == idx) {
+        _THROW(UnknownParamException, "No options with name [" + name + "]");
+    }
+    return OptHandle(idx);
+}
+
+FlagHandle Pattern::getFlagHandle(const str_t &name) const {
+    size_t idx = findName(ParamDescr::FlagParam, name.data(), name.size());
+    if (str_t::npos == idx) {
+        _THROW(UnknownParamException, "No flags with name [" + name + "]");
+    }
+    return FlagHandle(idx);
+}
+
+str_t Pattern::usage() const {
+    return "Usage here";
+}
+
+class NameOrder {
+    // Orders option indices by the canonical names.
+    const Pattern::Options &options_;
+    const StringPool &pool_;
+public:
+    NameOrder(const Pattern::Options &options, const StringPool &pool)
+            : options_(options), pool_(pool) {
+    }
+
+    bool operator()(unsigned int lhs, unsigned int rhs) const {
+        return std::strcmp(options_[lhs].getName(pool_),
+                           options_[rhs].getName(pool_)) < 0;
+    }
+};
+
+Argument &Pattern::addArg() {
+    arguments_.push_back(Argument(arguments_.size()));
+    argSlots_.push_back(0);
+    return arguments_.back();
+}
+
+Argument &Pattern::addArg(const str_t &name) {
+    // TODO: name collision check
+    arguments_.push_back(Argument(pool_, arguments_.size(), name));
+    argSlots_.push_back(0);
+    indexName(ParamDescr::ArgParam, arguments_.size() - 1, name.data(),
+              name.size());
+    return arguments_.back();
+}
+
+Flag &Pattern::addFlag(const str_t &name) {
+    // TODO: name collision check
+    flags_.push_back(Flag(pool_, name));
+    flags_.back().ordinal_ = nextOrdinal();
+    indexName(ParamDescr::FlagParam, flags_.size() - 1, name.data(),
+              name.size());
+    return flags_.back();
+}
+
+Option &Pattern::addOpt(const str_t &name) {
+    // TODO: name collision check
+    options_.push_back(Option(pool_, name));
+    options_.back().ordinal_ = nextOrdinal();
+    indexName(ParamDescr::OptParam, options_.size() - 1, name.data(),
+              name.size());
+    if (str_t::npos != name.find('.')) {
+        addToNamespaces(static_cast<unsigned int>(options_.size() - 1));
+    }
+    return options_.back();
+}
+
+void Pattern::addToNamespaces(unsigned int idx) {
+    // Only the options of the same namespaces are shifted, so options of
+    // new namespaces (e.g. of a plugin) cost nothing per existing option.
+    const char *name = options_[idx].getName(pool_);
+    NameOrder order(options_, pool_);
+    for (const char *dot = std::strchr(name, '.'); dot;
+         dot = std::strchr(dot + 1, '.')) {
+        NameIndex &group = namespaces_[str_t(name, dot + 1 - name)];
+        if (group.empty() || order(group.back(), idx)) {
+            group.push_back(idx);
+        } else {
+            group.insert(std::upper_bound(group.begin(), group.end(), idx,
+                                          order), idx);
+        }
+    }
+}
+
+RestArguments &Pattern::addRest(const str_t &name) {
+    if (hasRest_) {
+        _THROW(Exception, "Rest arguments are already defined");
+    }
+    rest_ = name.empty() ? RestArguments() : RestArguments(pool_, name);
+    hasRest_ = true;
+    return rest_;
+}
+
+struct NamedIndex {
+    const char *name;
+    unsigned int idx;
+
+    NamedIndex(const char *name, unsigned int idx) : name(name), idx(idx) {}
+
+    bool operator<(const NamedIndex &other) const {
+        return std::strcmp(name, other.name) < 0;
+    }
+};
+
+static bool isValidName(ParamDescr::Kind kind, const char *name,
+                        size_t length) {
+    // Same rules as Argument/ParamAliased::ensureName().
+    if (ParamDescr::ArgParam == kind) {
+        return length > 0 && '-' != name[0];
+    }
+    if (2 == length) {
+        return '-' == name[0] && '-' != name[1];
+    }
+    return length >= 4 && '-' == name[0] && '-' == name[1] && '-' != name[2];
+}
+
+static size_t checkDescr(const ParamDescr &descr, size_t &nameCount) {
+    // One pass over the names: every symbol is checked with the
+    // NameSymbols table, every name is checked at its end.
+    // Returns the size the param takes in the pool, counts the names.
+    if (descr.kind < ParamDescr::ArgParam ||
+        descr.kind > ParamDescr::OptParam) {
+        _THROW(Exception, "Bad param kind");
+    }
+    const char *names = descr.names ? descr.names : "";
+    const NameSymbols &symbols = NameSymbols::instance();
+    size_t begin = 0;
+    size_t end = 0;
+    for (;; ++end) {
+        char c = names[end];
+        if ('|' == c || '\0' == c) {
+            bool anonymous = 0 == end && ParamDescr::ArgParam == descr.kind;
+            if (!anonymous &&
+                !isValidName(descr.kind, names + begin, end - begin)) {
+                _THROW(BadNameException, "Bad param name "
+                                         "[" + str_t(names + begin,
+                                                     end - begin) + "]");
+            }
+            nameCount += anonymous ? 0 : 1;
+            if ('\0' == c) {
+                break;
+            }
+            if (ParamDescr::ArgParam == descr.kind) {
+                _THROW(BadNameException, "Argument can't have aliases "
+                                         "[" + str_t(names) + "]");
+            }
+            begin = end + 1;
+        } else if (!symbols[c]) {
+            _THROW(BadNameException, "Bad param name [" + str_t(names) + "]. "
+                                     "Forbidden symbols");
+        }
+    }
+    return end + 1 + (descr.defaultVal ? std::strlen(descr.defaultVal) : 0)
+           + (descr.descr ? std::strlen(descr.descr) : 0);
+}
+
+void Pattern::addTable(const ParamDescr *params, size_t count) {
+    // Everything is validated first, so a bad row leaves the pattern as is.
+    size_t poolSize = pool_.size();
+    size_t nameCount = 0;
+    size_t counts[ParamDescr::OptParam + 1] = {0, 0, 0};
+    for (size_t i = 0; i < count; ++i) {
+        poolSize += checkDescr(params[i], nameCount);
+        ++counts[params[i].kind];
+    }
+    pool_.reserve(poolSize);
+    growNames(nameCount);
+    arguments_.reserve(arguments_.size() + counts[ParamDescr::ArgParam]);
+    flags_.reserve(flags_.size() + counts[ParamDescr::FlagParam]);
+    options_.reserve(options_.size() + counts[ParamDescr::OptParam]);
+    argSlots_.reserve(argSlots_.size() + counts[ParamDescr::ArgParam]);
+    slots_.reserve(slots_.size() + counts[ParamDescr::FlagParam]
+                   + counts[ParamDescr::OptParam]);
+
+    size_t firstOpt = options_.size();
+    for (size_t i = 0; i < count; ++i) {
+        const ParamDescr &descr = params[i];
+        StringPool::Ref names = descr.names && *descr.names
+                                ? pool_.addList(descr.names, '|')
+                                : StringPool::emptyRef();
+        ParamGeneric *param = 0;
+        ParamValued *valued = 0;
+        switch (descr.kind) {
+            case ParamDescr::ArgParam:
+                arguments_.push_back(Argument(arguments_.size(), names));
+                argSlots_.push_back(0);
+                param = &arguments_.back();
+                valued = &arguments_.back();
+                break;
+            case ParamDescr::FlagParam:
+                flags_.push_back(Flag(names));
+                flags_.back().ordinal_ = nextOrdinal();
+                param = &flags_.back();
+                break;
+            case ParamDescr::OptParam:
+                options_.push_back(Option(names));
+                options_.back().ordinal_ = nextOrdinal();
+                param = &options_.back();
+                valued = &options_.back();
+                break;
+        }
+        if (descr.descr) {
+            param->descr_ = pool_.add(descr.descr, std::strlen(descr.descr));
+        }
+        if (valued && descr.defaultVal) {
+            valued->default_ = pool_.add(descr.defaultVal,
+                                         std::strlen(descr.defaultVal));
+            valued->hasDefault_ = true;
+        }
+        size_t idx = ParamDescr::ArgParam == descr.kind ? arguments_.size()
+                   : ParamDescr::FlagParam == descr.kind ? flags_.size()
+                   : options_.size();
+        indexNames(descr.kind, idx - 1, names);
+    }
+
+    // New dotted options are sorted by names kept next to the indices, so
+    // they come to their namespaces in order. Each namespace is then merged
+    // with its new options at once.
+    std::vector<NamedIndex> named;
+    for (size_t i = firstOpt; i < options_.size(); ++i) {
+        const char *name = options_[i].getName(pool_);
+        if (std::strchr(name, '.')) {
+            named.push_back(NamedIndex(name, static_cast<unsigned int>(i)));
+        }
+    }
+    std::sort(named.begin(), named.end());
+    // Namespace to its size before the table.
+    std::map<NameIndex *, size_t> merged;
+    for (std::vector<NamedIndex>::const_iterator it = named.begin();
+         it != named.end(); ++it) {
+        for (const char *dot = std::strchr(it->name, '.'); dot;
+             dot = std::strchr(dot + 1, '.')) {
+            NameIndex &group = namespaces_[str_t(it->name,
+                                                 dot + 1 - it->name)];
+            merged.insert(std::make_pair(&group, group.size()));
+            group.push_back(it->idx);
+        }
+    }
+    for (std::map<NameIndex *, size_t>::const_iterator it = merged.begin();
+         it != merged.end(); ++it) {
+        NameIndex &group = *it->first;
+        std::inplace_merge(group.begin(), group.begin() + it->second,
+                           group.end(), NameOrder(options_, pool_));
+    }
+}
+
+size_t Pattern::findName(ParamDescr::Kind kind, const char *name,
+                          size_t length) const {
+    _PHASE(PhaseLookup, lookupNs);
+    _STAT(lookups, 1);
+    if (0 == nameCount_) {
+        return str_t::npos;
+    }
+    unsigned int hash = hashBytes(name, length, kind);
+    size_t mask = names_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        _STAT(probes, 1);
+        const NameSlot &slot = names_[i];
+        if (0 == slot.idx) {
+            return str_t::npos;
+        }
+        if (slot.hash != hash || slot.kind != kind) {
+            continue;
+        }
+        if (paramOf(kind, slot.idx - 1).hasName(pool_, name, length)) {
+            return slot.idx - 1;
+        }
+    }
+}
+
+void Pattern::indexName(ParamDescr::Kind kind, size_t idx, const char *name,
+                        size_t length) {
+    if (0 == length) {
+        return;
+    }
+    // At most a half of the slots is used; the table doubles when full,
+    // so an insert is amortized O(1) however the pattern grows.
+    growNames(1);
+    unsigned int hash = hashBytes(name, length, kind);
+    size_t mask = names_.size() - 1;
+    size_t i = hash & mask;
+    for (; names_[i].idx; i = (i + 1) & mask) {
+        // A name taken by an earlier param of the kind keeps pointing to it.
+        if (names_[i].hash == hash && names_[i].kind == kind &&
+            paramOf(kind, names_[i].idx - 1).hasName(pool_, name, length)) {
+            return;
+        }
+    }
+    names_[i].hash = hash;
+    names_[i].idx = static_cast<unsigned int>(idx + 1);
+    names_[i].kind = kind;
+    nameCount_++;
+}
+
+const ParamGeneric &Pattern::paramOf(ParamDescr::Kind kind,
+                                     size_t idx) const {
+    switch (kind) {
+        case ParamDescr::ArgParam:
+            return arguments_[idx];
+        case ParamDescr::FlagParam:
+            return flags_[idx];
+        default:
+            return options_[idx];
+    }
+}
+
+void Pattern::indexNames(ParamDescr::Kind kind, size_t idx,
+                         const StringPool::Ref &names) {
+    const char *it = pool_.data(names);
+    const char *end = it + names.length;
+    while (it < end) {
+        size_t length = std::strlen(it);
+        indexName(kind, idx, it, length);
+        it += length + 1;
+    }
+}
+
+void Pattern::growNames(size_t count) {
+    size_t size = names_.empty() ? 16 : names_.size();
+    while (2 * (nameCount_ + count) > size) {
+        size *= 2;
+    }
+    if (size == names_.size()) {
+        return;
+    }
+    NameSlot empty = {0, 0, ParamDescr::ArgParam};
+    std::vector<NameSlot> names(size, empty);
+    size_t mask = names.size() - 1;
+    for (std::vector<NameSlot>::const_iterator it = names_.begin();
+         it != names_.end(); ++it) {
+        if (it->idx) {
+            size_t i = it->hash & mask;
+            while (names[i].idx) {
+                i = (i + 1) & mask;
+            }
+            names[i] = *it;
+        }
+    }
+    names_.swap(names);
+}
+
+size_t Pattern::nextOrdinal() {
+    slots_.push_back(0);
+    return ordinals_++;
+}
+
+Pattern::Binding *Pattern::findBinding(const Slots &slots, size_t idx) {
+    return slots[idx] ? &bindings_[slots[idx] - 1] : 0;
+}
+
+const Pattern::Binding *Pattern::findBinding(const Slots &slots,
+                                             size_t idx) const {
+    return slots[idx] ? &bindings_[slots[idx] - 1] : 0;
+}
+
+Pattern::Binding &Pattern::addBinding(Slots &slots, size_t idx) {
+    if (!slots[idx]) {
+        bindings_.push_back(Binding());
+        slots[idx] = static_cast<unsigned int>(bindings_.size());
+    }
+    return bindings_[slots[idx] - 1];
+}
+
+size_t Pattern::indexOf(const Flag &flag) const {
+    return flags_.indexOf(flag);
+}
+
+size_t Pattern::indexOf(const Option &option) const {
+    return options_.indexOf(option);
+}
+
+void Pattern::registerAlias(Flag &flag, const str_t &alias) {
+    // TODO: add collision check with other flags & options.
+    flag.addAlias(pool_, alias);
+    indexName(ParamDescr::FlagParam, indexOf(flag), alias.data(),
+              alias.size());
+}
+
+void Pattern::registerAlias(Option &option, const str_t &alias) {
+    // TODO: add collision check with other options & flags.
+    option.addAlias(pool_, alias);
+    indexName(ParamDescr::OptParam, indexOf(option), alias.data(),
+              alias.size());
+}
+
+void Pattern::registerMap(Option &option, Option::DuplicateKeys duplicates) {
+    if (option.isMap()) {
+        option.duplicateKeys_ = duplicates;
+        return;
+    }
+    const Binding *binding = findBinding(slots_, option.getOrdinal());
+    if (option.hasChoices() || option.hasDefault() ||
+        (binding && binding->target.isBound())) {
+        _THROW(BadValueException, "Option [" + option.getCanonicalName(pool_)
+                                  + "] with choices, a default or a binding "
+                                  "can't be a map");
+    }
+    option.mapSlot_ = mapCount_++;
+    option.duplicateKeys_ = duplicates;
+}
+
+void Pattern::setDescr(ParamGeneric &param, const str_t &descr) {
+    param.setDescr(pool_, descr);
+}
+
+void Pattern::setDefault(Argument &arg, const DefaultValue &val) {
+    assert(!arg.hasDefault());
+    // String defaults of unbound args need no slot, the pool has them.
+    if (findBinding(argSlots_, arg.getPos())
+        || DefaultValue::String != val.getType()) {
+        Binding &binding = addBinding(argSlots_, arg.getPos());
+        if (binding.target.isBound()) {
+            ParamBinding::Value value;
+            binding.target.convert(val.str(), value);
+            binding.value = value.num;
+        }
+        binding.type = val.getType();
+        binding.fallback = val.getValue().num;
+    }
+    arg.default_ = pool_.add(val.str());
+    arg.hasDefault_ = true;
+}
+
+void Pattern::setDefault(Option &option, const DefaultValue &val) {
+    assert(!option.hasDefault());
+    if (option.isMap()) {
+        _THROW(BadValueException, "Map option [" + option.getCanonicalName(pool_)
+                                  + "] can't have a default value");
+    }
+    Binding *binding = findBinding(slots_, option.getOrdinal());
+    ParamBinding::Value value;
+    option.defaultChoice_ = convertDefault(
+            option, binding ? binding->target : ParamBinding(), val.str(),
+            value);
+    if (binding || DefaultValue::String != val.getType()) {
+        Binding &dst = addBinding(slots_, option.getOrdinal());
+        dst.value = value.num;
+        dst.type = val.getType();
+        dst.fallback = val.getValue().num;
+    }
+    option.default_ = pool_.add(val.str());
+    option.hasDefault_ = true;
+}
+
+void Pattern::setBinding(Argument &arg, const ParamBinding &binding) {
+    if (!binding.isBound() && !findBinding(argSlots_, arg.getPos())) {
+        return;
+    }
+    Binding &dst = addBinding(argSlots_, arg.getPos());
+    if (arg.hasDefault() && binding.isBound()) {
+        ParamBinding::Value value;
+        binding.convert(getDefault(arg), value);
+        dst.value = value.num;
+    }
+    dst.target = binding;
+}
+
+void Pattern::setBinding(Flag &flag, const ParamBinding &binding) {
+    if (binding.isBound() && !binding.takesFlag()) {
+        _THROW(BadValueException, "Flag [" + flag.getCanonicalName(pool_) +
+                                  "] can be bound to bool only");
+    }
+    if (binding.isBound() || findBinding(slots_, flag.getOrdinal())) {
+        addBinding(slots_, flag.getOrdinal()).target = binding;
+    }
+}
+
+void Pattern::setBinding(Option &option, const ParamBinding &binding) {
+    if (option.isMap() && binding.isBound()) {
+        _THROW(BadValueException, "Map option [" + option.getCanonicalName(pool_)
+                                  + "] can't be bound");
+    }
+    if (!binding.isBound() && !findBinding(slots_, option.getOrdinal())) {
+        return;
+    }
+    Binding &dst = addBinding(slots_, option.getOrdinal());
+    if (option.hasDefault()) {
+        ParamBinding::Value value;
+        convertDefault(option, binding, getDefault(option), value);
+        dst.value = value.num;
+    }
+    dst.target = binding;
+}
+
+int Pattern::convertDefault(const Option &option, const ParamBinding &binding,
+                            const str_t &val, ParamBinding::Value &dst) const {
+    int choice = -1;
+    if (option.hasChoices()) {
+        choice = findChoice(option, val);
+        if (choice < 0) {
+            _THROW(BadValueException, "Default value [" + val + "] of option "
+                                      "[" + option.getCanonicalName(pool_) +
+                                      "] is not one of its choices");
+        }
+    }
+    if (binding.isBound()) {
+        if (choice >= 0 && binding.takesChoice()) {
+            binding.convertChoice(choice, dst);
+        } else {
+            binding.convert(val, dst);
+        }
+    }
+    return choice;
+}
+
+void Pattern::setChoices(Option &option, const str_t &choices) {
+    if (option.isMap()) {
+        _THROW(BadValueException, "Map option [" + option.getCanonicalName(pool_)
+                                  + "] can't have choices");
+    }
+    std::vector<str_t> values;
+    size_t begin = 0;
+    for (;;) {
+        size_t end = choices.find('|', begin);
+        values.push_back(choices.substr(begin, end - begin));
+        if (values.back().empty()) {
+            _THROW(BadValueException, "Empty choice in [" + choices + "]");
+        }
+        if (str_t::npos == end) {
+            break;
+        }
+        begin = end + 1;
+    }
+    ChoiceTable table;
+    table.build(pool_, values);
+    if (!option.hasChoices()) {
+        option.choiceSlot_ = choices_.size();
+        choices_.push_back(table);
+    } else {
+        choices_[option.choiceSlot_] = table;
+    }
+    if (option.hasDefault()) {
+        Binding *binding = findBinding(slots_, option.getOrdinal());
+        ParamBinding::Value value;
+        option.defaultChoice_ = convertDefault(
+                option, binding ? binding->target : ParamBinding(),
+                getDefault(option), value);
+        if (binding) {
+            binding->value = value.num;
+        }
+    }
+}
+
+int Pattern::findChoice(const Option &option, const str_t &val) const {
+    if (!option.hasChoices()) {
+        return -1;
+    }
+    return choices_[option.getChoiceSlot()].find(pool_, val);
+}
+
+static const size_t PresenceBits = sizeof(Pattern::PresenceWord) * CHAR_BIT;
+
+void Pattern::addConstraint(Constraint::Kind kind, const str_t &trigger,
+                            const str_t &names) {
+    std::vector<size_t> ordinals;
+    size_t begin = 0;
+    for (size_t end = 0; end <= names.size(); ++end) {
+        if (end == names.size() || '|' == names[end]) {
+            ordinals.push_back(ordinalOf(names.substr(begin, end - begin)));
+            begin = end + 1;
+        }
+    }
+    Constraint constraint;
+    constraint.kind = kind;
+    constraint.trigger = trigger.empty() ? 0 : ordinalOf(trigger);
+    constraint.begin = maskWords_.size();
+    std::sort(ordinals.begin(), ordinals.end());
+    for (std::vector<size_t>::const_iterator it = ordinals.begin();
+         it != ordinals.end(); ++it) {
+        size_t idx = *it / PresenceBits;
+        if (maskWords_.size() == constraint.begin ||
+            maskWords_.back().idx != idx) {
+            MaskWord word = {idx, 0};
+            maskWords_.push_back(word);
+        }
+        maskWords_.back().bits |= PresenceWord(1) << (*it % PresenceBits);
+    }
+    constraint.end = maskWords_.size();
+    constraints_.push_back(constraint);
+}
+
+size_t Pattern::ordinalOf(const str_t &name) const {
+    if (hasFlag(name)) {
+        return getFlag(name).getOrdinal();
+    }
+    return getOpt(name).getOrdinal();
+}
+
+const char *Pattern::nameOf(size_t ordinal) const {
+    for (size_t i = 0; i < flags_.size(); ++i) {
+        if (flags_[i].getOrdinal() == ordinal) {
+            return getName(flags_[i]);
+        }
+    }
+    for (size_t i = 0; i < options_.size(); ++i) {
+        if (options_[i].getOrdinal() == ordinal) {
+            return getName(options_[i]);
+        }
+    }
+    return "";
+}
+
+str_t Pattern::namesOf(const Constraint &constraint) const {
+    str_t result;
+    for (size_t i = constraint.begin; i < constraint.end; ++i) {
+        for (size_t bit = 0; bit < PresenceBits; ++bit) {
+            if (maskWords_[i].bits & (PresenceWord(1) << bit)) {
+                result += result.empty() ? "" : "|";
+                result += nameOf(maskWords_[i].idx * PresenceBits + bit);
+            }
+        }
+    }
+    return result;
+}
+
+void Pattern::checkConstraints(const Presence &presence) const {
+    // Only the failed constraint is turned back into names.
+    for (std::vector<Constraint>::const_iterator it = constraints_.begin();
+         it != constraints_.end(); ++it) {
+        if (Constraint::Requires == it->kind ||
+            Constraint::Conflicts == it->kind) {
+            size_t idx = it->trigger / PresenceBits;
+            PresenceWord bit = PresenceWord(1) << (it->trigger % PresenceBits);
+            if (!(presence[idx] & bit)) {
+                continue;
+            }
+        }
+
+        bool all = true;
+        bool any = false;
+        bool many = false;
+        for (size_t i = it->begin; i < it->end; ++i) {
+            const MaskWord &mask = maskWords_[i];
+            PresenceWord present = presence[mask.idx] & mask.bits;
+            all = all && present == mask.bits;
+            many = many || (present && (any || (present & (present - 1))));
+            any = any || present;
+        }
+
+        switch (it->kind) {
+            case Constraint::Requires:
+                if (!all) {
+                    _THROW(MissingParamException,
+                           "[" + str_t(nameOf(it->trigger)) + "] requires "
+                           "[" + namesOf(*it) + "]");
+                }
+                break;
+            case Constraint::Conflicts:
+                if (any) {
+                    _THROW(ConflictingParamsException,
+                           "[" + str_t(nameOf(it->trigger)) + "] conflicts "
+                           "with [" + namesOf(*it) + "]");
+                }
+                break;
+            case Constraint::Exclusive:
+                if (many) {
+                    _THROW(ConflictingParamsException,
+                           "Only one of [" + namesOf(*it) + "] is allowed");
+                }
+                break;
+            case Constraint::AtLeastOne:
+                if (!any) {
+                    _THROW(MissingParamException,
+                           "One of [" + namesOf(*it) + "] is required");
+                }
+                break;
+        }
+    }
+}
+
+
+PatternBuilder::PatternBuilder(Pattern &pattern)
+        : pattern_(pattern) {
+}
+
+ArgBuilder PatternBuilder::arg() {
+    _PHASE(PhaseBuild, buildNs);
+    return ArgBuilder(pattern_.addArg(), pattern_);
+}
+
+ArgBuilder PatternBuilder::arg(const str_t &name) {
+    _PHASE(PhaseBuild, buildNs);
+    return ArgBuilder(pattern_.addArg(name), pattern_);
+}
+
+FlagBuilder PatternBuilder::flag(const str_t &name) {
+    _PHASE(PhaseBuild, buildNs);
+    return FlagBuilder(pattern_.addFlag(name), pattern_);
+}
+
+OptBuilder PatternBuilder::opt(const str_t &name) {
+    _PHASE(PhaseBuild, buildNs);
+    return OptBuilder(pattern_.addOpt(name), pattern_);
+}
+
+PatternBuilder PatternBuilder::registered() {
+    // New nodes are pushed to the head of the registry, so only those in
+    // front of the head seen by the previous call are added.
+    _PHASE(PhaseBuild, buildNs);
+    const OptionRegistration *head = OptionRegistration::first();
+    for (const OptionRegistration *it = head;
+         it != pattern_.registered_; it = it->next()) {
+        if (it->isFlag()) {
+            Flag &flag = pattern_.addFlag(it->getName());
+            pattern_.setBinding(flag, it->getBinding());
+            pattern_.setDescr(flag, it->getDescr());
+        } else {
+            Option &option = pattern_.addOpt(it->getName());
+            pattern_.setBinding(option, it->getBinding());
+            pattern_.setDescr(option, it->getDescr());
+        }
+    }
+    pattern_.registered_ = head;
+    return PatternBuilder(pattern_);
+}
+
+PatternBuilder PatternBuilder::dependsOn(const str_t &name,
+                                         const str_t &names) {
+    _PHASE(PhaseBuild, buildNs);
+    pattern_.addConstraint(Pattern::Constraint::Requires, name, names);
+    return PatternBuilder(pattern_);
+}
+
+PatternBuilder PatternBuilder::conflicts(const str_t &name,
+                                         const str_t &names) {
+    _PHASE(PhaseBuild, buildNs);
+    pattern_.addConstraint(Pattern::Constraint::Conflicts, name, names);
+    return PatternBuilder(pattern_);
+}
+
+PatternBuilder PatternBuilder::exclusive(const str_t &names) {
+    _PHASE(PhaseBuild, buildNs);
+    pattern_.addConstraint(Pattern::Constraint::Exclusive, "", names);
+    return PatternBuilder(pattern_);
+}
+
+PatternBuilder PatternBuilder::atLeastOne(const str_t &names) {
+    _PHASE(PhaseBuild, buildNs);
+    pattern_.addConstraint(Pattern::Constraint::AtLeastOne, "", names);
+    return PatternBuilder(pattern_);
+}
+
+PatternBuilder PatternBuilder::table(const ParamDescr *params, size_t count) {
+    _PHASE(PhaseBuild, buildNs);
+    pattern_.addTable(params, count);
+    return PatternBuilder(pattern_);
+}
+
+RestBuilder PatternBuilder::rest() {
+    _PHASE(PhaseBuild, buildNs);
+    return RestBuilder(pattern_.addRest(""), pattern_);
+}
+
+RestBuilder PatternBuilder::rest(const str_t &name) {
+    _PHASE(PhaseBuild, buildNs);
+    if (name.empty()) {
+        _THROW(BadNameException, "Empty param name");
+    }
+    return RestBuilder(pattern_.addRest(name), pattern_);
+}
+
+void PatternBuilder::registerAlias(Flag &flag, const str_t &alias) {
+    pattern_.registerAlias(flag, alias);
+}
+
+void PatternBuilder::registerAlias(Option &option, const str_t &alias) {
+    pattern_.registerAlias(option, alias);
+}
+
+void PatternBuilder::registerMap(Option &option,
+                                 Option::DuplicateKeys duplicates) {
+    pattern_.registerMap(option, duplicates);
+}
+
+void PatternBuilder::setDescr(ParamGeneric &param, const str_t &descr) {
+    pattern_.setDescr(param, descr);
+}
+
+void PatternBuilder::setDefault(Argument &arg, const DefaultValue &val) {
+    pattern_.setDefault(arg, val);
+}
+
+void PatternBuilder::setDefault(Option &option, const DefaultValue &val) {
+    pattern_.setDefault(option, val);
+}
+
+void PatternBuilder::setBinding(Argument &arg, const ParamBinding &binding) {
+    pattern_.setBinding(arg, binding);
+}
+
+void PatternBuilder::setBinding(Flag &flag, const ParamBinding &binding) {
+    pattern_.setBinding(flag, binding);
+}
+
+void PatternBuilder::setBinding(Option &option, const ParamBinding &binding) {
+    pattern_.setBinding(option, binding);
+}
+
+void PatternBuilder::setChoices(Option &option, const str_t &choices) {
+    pattern_.setChoices(option, choices);
+}
+
+
+ArgBuilder::ArgBuilder(Argument &arg, Pattern &pattern)
+        : PatternBuilder(pattern), arg_(arg) {
+}
+
+ArgBuilder ArgBuilder::bindTo(const ParamBinding &binding) {
+    _PHASE(PhaseBuild, buildNs);
+    setBinding(arg_, binding);
+    return ArgBuilder(arg_, pattern_);
+}
+
+ArgDescrBuilder ArgBuilder::defaultVal(const DefaultValue &val) {
+    _PHASE(PhaseBuild, buildNs);
+    setDefault(arg_, val);
+    return ArgDescrBuilder(arg_, pattern_);
+}
+
+ArgValueBuilder ArgBuilder::descr(const str_t &descr) {
+    _PHASE(PhaseBuild, buildNs);
+    setDescr(arg_, descr);
+    return ArgValueBuilder(arg_, pattern_);
+}
+
+
+ArgDescrBuilder::ArgDescrBuilder(Argument &arg, Pattern &pattern)
+        : PatternBuilder(pattern), arg_(arg) {
+}
+
+PatternBuilder ArgDescrBuilder::descr(const str_t &descr) {
+    _PHASE(PhaseBuild, buildNs);
+    setDescr(arg_, descr);
+    return PatternBuilder(pattern_);
+}
+
+
+ArgValueBuilder::ArgValueBuilder(Argument &arg, Pattern &pattern)
+        : PatternBuilder(pattern), arg_(arg) {
+}
+
+PatternBuilder ArgValueBuilder::defaultVal(const DefaultValue &val) {
+    _PHASE(PhaseBuild, buildNs);
+    setDefault(arg_, val);
+    return PatternBuilder(pattern_);
+}
+
+
+RestBuilder::RestBuilder(RestArguments &rest, Pattern &pattern)
+        : PatternBuilder(pattern), rest_(rest) {
+}
+
+RestBuilder RestBuilder::count(size_t minCount, size_t maxCount) {
+    _PHASE(PhaseBuild, buildNs);
+    rest_.setCount(minCount, maxCount);
+    return RestBuilder(rest_, pattern_);
+}
+
+RestBuilder RestBuilder::descr(const str_t &descr) {
+    _PHASE(PhaseBuild, buildNs);
+    setDescr(rest_, descr);
+    return RestBuilder(rest_, pattern_);
+}
+
+
+template<typename T>
+AliasBuilder<T>::AliasBuilder(T &param, Pattern &pattern)
+        : PatternBuilder(pattern), param_(param) {
+}
+
+template<typename T>
+AliasBuilder<T> AliasBuilder<T>::alias(const str_t &alias) {
+    _PHASE(PhaseBuild, buildNs);
+    registerAlias(param_, alias);
+    return AliasBuilder(param_, pattern_);
+}
+
+template class AliasBuilder<Flag>;
+template class AliasBuilder<Option>;
+
+
+FlagBuilder::FlagBuilder(Flag &flag, Pattern &pattern)
+        : PatternBuilder(pattern), flag_(flag) {
+}
+
+FlagBuilder FlagBuilder::alias(const str_t &alias) {
+    _PHASE(PhaseBuild, buildNs);
+    registerAlias(flag_, alias);
+    return FlagBuilder(flag_, pattern_);
+}
+
+FlagBuilder FlagBuilder::bindTo(bool *target) {
+    _PHASE(PhaseBuild, buildNs);
+    setBinding(flag_, ParamBinding(target));
+    return FlagBuilder(flag_, pattern_);
+}
+
+FlagBuilder FlagBuilder::bindTo(const ParamBinding &binding) {
+    _PHASE(PhaseBuild, buildNs);
+    setBinding(flag_, binding);
+    return FlagBuilder(flag_, pattern_);
+}
+
+AliasBuilder<Flag> FlagBuilder::descr(const str_t &descr) {
+    setDescr(flag_, descr);
+    return AliasBuilder<Flag>(flag_, pattern_);
+}
+
+
+OptBuilder::OptBuilder(Option &option, Pattern &pattern)
+        : PatternBuilder(pattern), option_(option) {
+}
+
+OptBuilder OptBuilder::alias(const str_t &alias) {
+    _PHASE(PhaseBuild, buildNs);
+    registerAlias(option_, alias);
+    return OptBuilder(option_, pattern_);
+}
+
+OptBuilder OptBuilder::bindTo(const ParamBinding &binding) {
+    _PHASE(PhaseBuild, buildNs);
+    setBinding(option_, binding);
+    return OptBuilder(option_, pattern_);
+}
+
+OptBuilder OptBuilder::choices(const str_t &choices) {
+    _PHASE(PhaseBuild, buildNs);
+    setChoices(option_, choices);
+    return OptBuilder(option_, pattern_);
+}
+
+OptBuilder OptBuilder::map(Option::DuplicateKeys duplicates) {
+    _PHASE(PhaseBuild, buildNs);
+    registerMap(option_, duplicates);
+    return OptBuilder(option_, pattern_);
+}
+
+OptDescrBuilder OptBuilder::defaultVal(const DefaultValue &val) {
+    _PHASE(PhaseBuild, buildNs);
+    setDefault(option_, val);
+    return OptDescrBuilder(option_, pattern_);
+}
+
+OptValueBuilder OptBuilder::descr(const str_t &descr) {
+    _PHASE(PhaseBuild, buildNs);
+    setDescr(option_, descr);
+    return OptValueBuilder(option_, pattern_);
+}
+
+
+OptDescrBuilder::OptDescrBuilder(Option &option, Pattern &pattern)
+        : PatternBuilder(pattern), option_(option) {
+}
+
+AliasBuilder<Option> OptDescrBuilder::descr(const str_t &descr) {
+    _PHASE(PhaseBuild, buildNs);
+    setDescr(option_, descr);
+    return AliasBuilder<Option>(option_, pattern_);
+}
+
+
+OptValueBuilder::OptValueBuilder(Option &option, Pattern &pattern)
+        : PatternBuilder(pattern), option_(option) {
+}
+
+AliasBuilder<Option> OptValueBuilder::defaultVal(const DefaultValue &val) {
+    _PHASE(PhaseBuild, buildNs);
+    setDefault(option_, val);
+    return AliasBuilder<Option>(option_, pattern_);
+}
+
+
+ParsedParam::ParsedParam(const str_t &val, int choice)
+        : val_(val), choice_(choice), defaultType_(DefaultValue::String) {
+    default_.ul = 0;
+}
+
+ParsedParam::operator std::string() const {
+    return str_t(asString());
+}
+
+const str_t &ParsedParam::asString() const {
+    return val_;
+}
+
+int ParsedParam::asInt() const {
+    if (DefaultValue::Int == defaultType_) {
+        return default_.i;
+    }
+    int result = 0;
+    convertValue(asString(), result);
+    return result;
+}
+
+double ParsedParam::asDouble() const {
+    if (DefaultValue::Double == defaultType_) {
+        return default_.d;
+    }
+    if (DefaultValue::Int == defaultType_) {
+        return default_.i;
+    }
+    double result = 0;
+    convertValue(asString(), result);
+    return result;
+}
+
+int ParsedParam::asChoice() const {
+    if (choice_ < 0) {
+        _THROW(Exception, "Value [" + asString() + "] is not a choice");
+    }
+    return choice_;
+}
+
+
+ParsedArgParam::ParsedArgParam(const Argument &argument, const str_t &val)
+        : ParsedParam(val), argument_(&argument) {
+}
+
+const Argument &ParsedArgParam::getArg() const {
+    return *argument_;
+}
+
+
+class SnapshotWriter {
+    // Bounded output of CmdLineParams snapshots. Counts all the bytes, but
+    // writes only those that fit into the capacity.
+    char *dst_;
+    size_t capacity_;
+    size_t size_;
+
+public:
+    SnapshotWriter(char *dst, size_t capacity)
+            : dst_(dst), capacity_(capacity), size_(0) {
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    void put(char c) {
+        if (size_ < capacity_) {
+            dst_[size_] = c;
+        }
+        ++size_;
+    }
+
+    void put(const char *src, size_t length) {
+        if (size_ < capacity_) {
+            std::memcpy(dst_ + size_, src,
+                        std::min(length, capacity_ - size_));
+        }
+        size_ += length;
+    }
+
+    void put(const char *str) {
+        put(str, std::strlen(str));
+    }
+
+    void putU32(unsigned int val) {
+        put(reinterpret_cast<const char *>(&val), sizeof(val));
+    }
+
+    // Length-prefixed and '\0'-terminated, so strings can be used in place.
+    void putStr(const char *str, size_t length) {
+        putU32(static_cast<unsigned int>(length));
+        put(str, length);
+        put('\0');
+    }
+
+    void putBits(const std::vector<bool> &bits) {
+        for (size_t i = 0; i < bits.size(); i += 8) {
+            unsigned char byte = 0;
+            for (size_t bit = 0; bit < 8 && i + bit < bits.size(); ++bit) {
+                byte |= static_cast<unsigned char>(bits[i + bit] << bit);
+            }
+            put(static_cast<char>(byte));
+        }
+    }
+
+    void putNumber(size_t val) {
+        char digits[24];
+        size_t length = 0;
+        do {
+            digits[sizeof(digits) - ++length] = static_cast<char>('0' + val % 10);
+            val /= 10;
+        } while (val);
+        put(digits + sizeof(digits) - length, length);
+    }
+
+    void putJsonStr(const char *str, size_t length) {
+        static const char hex[] = "0123456789abcdef";
+        put('"');
+        for (const char *end = str + length; str < end; ++str) {
+            unsigned char c = static_cast<unsigned char>(*str);
+            if ('"' == c || '\\' == c) {
+                put('\\');
+                put(static_cast<char>(c));
+            } else if (c < 0x20) {
+                put("\\u00");
+                put(hex[c >> 4]);
+                put(hex[c & 0xf]);
+            } else {
+                put(static_cast<char>(c));
+            }
+        }
+        put('"');
+    }
+
+    void putJsonStr(const char *str) {
+        putJsonStr(str, std::strlen(str));
+    }
+};
+
+
+class SnapshotReader {
+    // Bounds-checked input of snapshots made with SnapshotWriter.
+    const char *it_;
+    const char *end_;
+
+public:
+    SnapshotReader(const char *src, size_t size)
+            : it_(src), end_(src + size) {
+    }
+
+    bool atEnd() const {
+        return it_ == end_;
+    }
+
+    const char *take(size_t length) {
+        if (static_cast<size_t>(end_ - it_) < length) {
+            _THROW(Exception, "Truncated params snapshot");
+        }
+        const char *result = it_;
+        it_ += length;
+        return result;
+    }
+
+    unsigned int takeU32() {
+        unsigned int val = 0;
+        std::memcpy(&val, take(sizeof(val)), sizeof(val));
+        return val;
+    }
+
+    // Returns the string in place, sets its length.
+    const char *takeStr(size_t &length) {
+        length = takeU32();
+        const char *str = take(length + 1);
+        if (str[length] != '\0') {
+            _THROW(Exception, "Corrupted params snapshot");
+        }
+        return str;
+    }
+
+    void takeBits(std::vector<bool> &bits) {
+        const char *bytes = take((bits.size() + 7) / 8);
+        for (size_t i = 0; i < bits.size(); ++i) {
+            bits[i] = (static_cast<unsigned char>(bytes[i / 8]) >> (i % 8)) & 1;
+        }
+    }
+};
+
+
+// Binary snapshot: magic, param counts, flag and passed option bitmaps,
+// then values of args, passed options (with choice ids, or the entries of
+// maps) and rest args. Numbers use the native byte order.
+static const char SnapshotMagic[4] = {'C', 'P', 'O', 2};
+
+
+static const ParsedParam &notPassed() {
+    // Value of params added to the pattern after the match.
+    static const ParsedParam empty;
+    return empty;
 }
 
-str_t Pattern::usage() const {
-    return "Usage here";
+
+ParamGroup::ParamGroup(const CmdLineParams &params,
+                       const unsigned int *begin, size_t size)
+        : params_(&params), begin_(begin), size_(size) {
 }
 
-Argument &Pattern::addArg() {
-    arguments_.push_back(Argument(arguments_.size()));
-    return arguments_.back();
+size_t ParamGroup::size() const {
+    return size_;
 }
 
-Argument &Pattern::addArg(const str_t &name) {
-    // TODO: name collision check
-    arguments_.push_back(Argument(arguments_.size(), name));
-    return arguments_.back();
+bool ParamGroup::empty() const {
+    return 0 == size_;
 }
 
-Flag &Pattern::addFlag(const str_t &name) {
-    // TODO: name collision check
-    flags_.push_back(Flag(name));
-    return flags_.back();
+const Option &ParamGroup::getOpt(size_t idx) const {
+    assert(idx < size_);
+    return params_->getPattern().options_[begin_[idx]];
 }
 
-Option &Pattern::addOpt(const str_t &name) {
-    // TODO: name collision check
-    options_.push_back(Option(name));
-    return options_.back();
+const char *ParamGroup::getName(size_t idx) const {
+    return params_->getPattern().getName(getOpt(idx));
 }
 
-void Pattern::registerAlias(Flag &flag, const str_t &alias) {
-    // TODO: add collision check with other flags & options.
-    flag.addAlias(alias);
+bool ParamGroup::has(size_t idx) const {
+    assert(idx < size_);
+    return begin_[idx] < params_->passedOptions_.size()
+           && params_->passedOptions_[begin_[idx]];
 }
 
-void Pattern::registerAlias(Option &option, const str_t &alias) {
-    // TODO: add collision check with other options & flags.
-    option.addAlias(alias);
+const ParsedParam &ParamGroup::get(size_t idx) const {
+    assert(idx < size_);
+    if (begin_[idx] >= params_->options_.size()) {
+        return notPassed();
+    }
+    return params_->options_[begin_[idx]];
 }
 
 
-PatternBuilder::PatternBuilder(Pattern &pattern)
-        : pattern_(pattern) {
+ParamMap::ParamMap() {
 }
 
-ArgBuilder PatternBuilder::arg() {
-    return ArgBuilder(pattern_.addArg(), pattern_);
+size_t ParamMap::size() const {
+    return entries_.size();
 }
 
-ArgBuilder PatternBuilder::arg(const str_t &name) {
-    return ArgBuilder(pattern_.addArg(name), pattern_);
+bool ParamMap::empty() const {
+    return entries_.empty();
 }
 
-FlagBuilder PatternBuilder::flag(const str_t &name) {
-    return FlagBuilder(pattern_.addFlag(name), pattern_);
+const ParamMap::Entry &ParamMap::operator[](size_t idx) const {
+    assert(idx < entries_.size());
+    return entries_[idx];
 }
 
-OptBuilder PatternBuilder::opt(const str_t &name) {
-    return OptBuilder(pattern_.addOpt(name), pattern_);
+const ParamMap::Entry *ParamMap::begin() const {
+    return entries_.empty() ? 0 : &entries_[0];
 }
 
-void PatternBuilder::registerAlias(Flag &flag, const str_t &alias) {
-    pattern_.registerAlias(flag, alias);
+const ParamMap::Entry *ParamMap::end() const {
+    return begin() + entries_.size();
 }
 
-void PatternBuilder::registerAlias(Option &option, const str_t &alias) {
-    pattern_.registerAlias(option, alias);
+const ParamMap::Entry *ParamMap::find(const char *key, size_t length) const {
+    if (entries_.empty()) {
+        return 0;
+    }
+    const Slot &slot = slots_[slotOf(key, length, hashBytes(key, length, 0))];
+    return slot.entry ? &entries_[slot.entry - 1] : 0;
 }
 
-
-ArgBuilder::ArgBuilder(Argument &arg, Pattern &pattern)
-        : PatternBuilder(pattern), arg_(arg) {
+bool ParamMap::has(const str_t &key) const {
+    return 0 != find(key.data(), key.size());
 }
 
-ArgDescrBuilder ArgBuilder::defaultVal(const str_t &val) {
-    arg_.setDefault(val);
-    return ArgDescrBuilder(arg_, pattern_);
+str_t ParamMap::get(const str_t &key) const {
+    const Entry *entry = find(key.data(), key.size());
+    if (!entry) {
+        _THROW(MissingParamException, "No key [" + key + "] in the map");
+    }
+    return str_t(entry->value, entry->valueLength);
 }
 
-ArgValueBuilder ArgBuilder::descr(const str_t &descr) {
-    arg_.setDescr(descr);
-    return ArgValueBuilder(arg_, pattern_);
+void ParamMap::clear() {
+    entries_.clear();
+    Slot empty = {0, 0};
+    std::fill(slots_.begin(), slots_.end(), empty);
 }
 
-
-ArgDescrBuilder::ArgDescrBuilder(Argument &arg, Pattern &pattern)
-        : PatternBuilder(pattern), arg_(arg) {
+ParamMap::Entry &ParamMap::insert(const char *key, size_t length,
+                                  bool &inserted) {
+    // At most a half of the slots is used, so probe sequences stay short.
+    if (2 * (entries_.size() + 1) > slots_.size()) {
+        grow();
+    }
+    unsigned int hash = hashBytes(key, length, 0);
+    Slot &slot = slots_[slotOf(key, length, hash)];
+    inserted = 0 == slot.entry;
+    if (inserted) {
+        if (entries_.size() == entries_.capacity()) {
+            _STAT(allocations, 1);
+        }
+        Entry entry = {key, length, 0, 0};
+        entries_.push_back(entry);
+        slot.hash = hash;
+        slot.entry = static_cast<unsigned int>(entries_.size());
+    }
+    return entries_[slot.entry - 1];
+}
+
+size_t ParamMap::slotOf(const char *key, size_t length,
+                        unsigned int hash) const {
+    // The slot of the key or the empty one where it would be inserted.
+    size_t mask = slots_.size() - 1;
+    for (size_t idx = hash & mask;; idx = (idx + 1) & mask) {
+        _STAT(probes, 1);
+        const Slot &slot = slots_[idx];
+        if (0 == slot.entry) {
+            return idx;
+        }
+        const Entry &entry = entries_[slot.entry - 1];
+        if (slot.hash == hash && entry.keyLength == length
+            && 0 == std::memcmp(entry.key, key, length)) {
+            return idx;
+        }
+    }
 }
 
-PatternBuilder ArgDescrBuilder::descr(const str_t &descr) {
-    arg_.setDescr(descr);
-    return PatternBuilder(pattern_);
+void ParamMap::grow() {
+    _STAT(allocations, 1);
+    Slot empty = {0, 0};
+    std::vector<Slot> slots(slots_.empty() ? 16 : 2 * slots_.size(), empty);
+    size_t mask = slots.size() - 1;
+    for (std::vector<Slot>::const_iterator it = slots_.begin();
+         it != slots_.end(); ++it) {
+        if (it->entry) {
+            size_t idx = it->hash & mask;
+            while (slots[idx].entry) {
+                idx = (idx + 1) & mask;
+            }
+            slots[idx] = *it;
+        }
+    }
+    slots_.swap(slots);
 }
 
 
-ArgValueBuilder::ArgValueBuilder(Argument &arg, Pattern &pattern)
-        : PatternBuilder(pattern), arg_(arg) {
+CmdLineParams::CmdLineParams(const Pattern &pattern)
+        : pattern_(&pattern), flags_(pattern.flags_.size()),
+          options_(pattern.options_.size()),
+          passedOptions_(pattern.options_.size()), maps_(pattern.mapCount_) {
 }
 
-PatternBuilder ArgValueBuilder::defaultVal(const str_t &val) {
-    arg_.setDefault(val);
-    return PatternBuilder(pattern_);
+CmdLineParams::CmdLineParams(const CmdLineParams &other)
+        : pattern_(other.pattern_), arguments_(other.arguments_),
+          flags_(other.flags_), options_(other.options_),
+          passedOptions_(other.passedOptions_), maps_(other.maps_),
+          rest_(other.rest_),
+          restData_(other.restData_), restArgv_(other.restArgv_),
+          mapData_(other.mapData_) {
+    _STAT(copies, 1);
+    rebindLoaded();
 }
 
-
-template<typename T>
-AliasBuilder<T>::AliasBuilder(T &param, Pattern &pattern)
-        : PatternBuilder(pattern), param_(param) {
+CmdLineParams &CmdLineParams::operator=(const CmdLineParams &other) {
+    CmdLineParams(other).swap(*this);
+    return *this;
 }
 
-template<typename T>
-AliasBuilder<T> AliasBuilder<T>::alias(const str_t &alias) {
-    registerAlias(param_, alias);
-    return AliasBuilder(param_, pattern_);
+#ifdef CPPARSEOPT_MOVE
+CmdLineParams::CmdLineParams(CmdLineParams &&other) noexcept
+        : pattern_(other.pattern_) {
+    swap(other);
 }
 
-template class AliasBuilder<Flag>;
-template class AliasBuilder<Option>;
-
-
-FlagBuilder::FlagBuilder(Flag &flag, Pattern &pattern)
-        : PatternBuilder(pattern), flag_(flag) {
+CmdLineParams &CmdLineParams::operator=(CmdLineParams &&other) noexcept {
+    swap(other);
+    return *this;
 }
+#endif
 
-FlagBuilder FlagBuilder::alias(const str_t &alias) {
-    registerAlias(flag_, alias);
-    return FlagBuilder(flag_, pattern_);
+void CmdLineParams::swap(CmdLineParams &other) CPPARSEOPT_NOEXCEPT {
+    std::swap(pattern_, other.pattern_);
+    arguments_.swap(other.arguments_);
+    flags_.swap(other.flags_);
+    options_.swap(other.options_);
+    passedOptions_.swap(other.passedOptions_);
+    maps_.swap(other.maps_);
+    std::swap(rest_, other.rest_);
+    restData_.swap(other.restData_);
+    restArgv_.swap(other.restArgv_);
+    mapData_.swap(other.mapData_);
+    rebindLoaded();
+    other.rebindLoaded();
 }
 
-
-AliasBuilder<Flag> FlagBuilder::descr(const str_t &descr) {
-    flag_.setDescr(descr);
-    return AliasBuilder<Flag>(flag_, pattern_);
+const ParsedParam &CmdLineParams::getArg(const str_t &name) const {
+    return get(getPattern().getArgHandle(name));
 }
 
-
-OptBuilder::OptBuilder(Option &option, Pattern &pattern)
-        : PatternBuilder(pattern), option_(option) {
+const ParsedParam &CmdLineParams::getArg(size_t pos) const {
+    return get(getPattern().getArgHandle(pos));
 }
 
-OptBuilder OptBuilder::alias(const str_t &alias) {
-    registerAlias(option_, alias);
-    return OptBuilder(option_, pattern_);
+const ParsedParam &CmdLineParams::getOpt(const str_t &name) const {
+    OptHandle handle = getPattern().getOptHandle(name);
+    if (!has(handle)) {
+        _THROW(MissingParamException, "Option [" + name + "] was not passed");
+    }
+    return get(handle);
 }
 
-
-OptDescrBuilder OptBuilder::defaultVal(const str_t &val) {
-    option_.setDefault(val);
-    return OptDescrBuilder(option_, pattern_);
+bool CmdLineParams::hasOpt(const str_t &name) const {
+    return has(getPattern().getOptHandle(name));
 }
 
-OptValueBuilder OptBuilder::descr(const str_t &descr) {
-    option_.setDescr(descr);
-    return OptValueBuilder(option_, pattern_);
+bool CmdLineParams::hasFlag(const str_t &name) const {
+    return get(getPattern().getFlagHandle(name));
 }
 
-
-OptDescrBuilder::OptDescrBuilder(Option &option, Pattern &pattern)
-        : PatternBuilder(pattern), option_(option) {
+const ParsedParam &CmdLineParams::get(const ArgHandle &handle) const {
+    if (handle.getIndex() >= arguments_.size()) {
+        return notPassed();
+    }
+    return arguments_[handle.getIndex()];
 }
 
-AliasBuilder<Option> OptDescrBuilder::descr(const str_t &descr) {
-    option_.setDescr(descr);
-    return AliasBuilder<Option>(option_, pattern_);
+const ParsedParam &CmdLineParams::get(const OptHandle &handle) const {
+    if (handle.getIndex() >= options_.size()) {
+        return notPassed();
+    }
+    return options_[handle.getIndex()];
 }
 
+bool CmdLineParams::get(const FlagHandle &handle) const {
+    // Flags added to the pattern after the match were not passed.
+    return handle.getIndex() < flags_.size() && flags_[handle.getIndex()];
+}
 
-OptValueBuilder::OptValueBuilder(Option &option, Pattern &pattern)
-        : PatternBuilder(pattern), option_(option) {
+bool CmdLineParams::has(const OptHandle &handle) const {
+    return handle.getIndex() < passedOptions_.size()
+           && passedOptions_[handle.getIndex()];
 }
 
-AliasBuilder<Option> OptValueBuilder::defaultVal(const str_t &val) {
-    option_.setDefault(val);
-    return AliasBuilder<Option>(option_, pattern_);
+const ParamMap &CmdLineParams::getMap(const str_t &name) const {
+    OptHandle handle = getPattern().getOptHandle(name);
+    if (!getPattern().options_[handle.getIndex()].isMap()) {
+        _THROW(UnknownParamException, "Option [" + name + "] is not a map");
+    }
+    return getMap(handle);
 }
 
+const ParamMap &CmdLineParams::getMap(const OptHandle &handle) const {
+    static const ParamMap empty;
+    const Option &option = getPattern().options_[handle.getIndex()];
+    assert(option.isMap());
+    // Maps added to the pattern after the match are empty.
+    if (option.getMapSlot() >= maps_.size()) {
+        return empty;
+    }
+    return maps_[option.getMapSlot()];
+}
 
-ParsedParam::ParsedParam(const str_t &val)
-        : val_(val) {
+const ArgSpan &CmdLineParams::getRest() const {
+    getPattern().getRest();
+    return rest_;
 }
 
-ParsedParam::operator std::string() const {
-    return str_t(asString());
+const Pattern &CmdLineParams::getPattern() const {
+    return *pattern_;
 }
 
-const str_t &ParsedParam::asString() const {
-    return val_;
+ParamGroup CmdLineParams::group(const str_t &prefix) const {
+    str_t ns = prefix;
+    if (ns.empty() || '.' != ns[ns.size() - 1]) {
+        ns += '.';
+    }
+    Pattern::Namespaces::const_iterator it = pattern_->namespaces_.find(ns);
+    if (it == pattern_->namespaces_.end()) {
+        return ParamGroup(*this, 0, 0);
+    }
+    return ParamGroup(*this, &it->second[0], it->second.size());
+}
+
+size_t CmdLineParams::writeBinary(char *dst, size_t capacity) const {
+    SnapshotWriter out(dst, capacity);
+    out.put(SnapshotMagic, sizeof(SnapshotMagic));
+    out.putU32(static_cast<unsigned int>(arguments_.size()));
+    out.putU32(static_cast<unsigned int>(flags_.size()));
+    out.putU32(static_cast<unsigned int>(options_.size()));
+    out.putU32(static_cast<unsigned int>(rest_.size()));
+    out.putBits(flags_);
+    out.putBits(passedOptions_);
+    for (ArgParams::const_iterator it = arguments_.begin();
+         it != arguments_.end(); ++it) {
+        out.putStr(it->asString().data(), it->asString().size());
+    }
+    for (size_t i = 0; i < options_.size(); ++i) {
+        if (!passedOptions_[i]) {
+            continue;
+        }
+        const Option &option = pattern_->options_[i];
+        if (option.isMap()) {
+            // Entry count, then keys and values in the insertion order.
+            const ParamMap &map = maps_[option.getMapSlot()];
+            out.putU32(static_cast<unsigned int>(map.size()));
+            for (const ParamMap::Entry *it = map.begin(); it != map.end();
+                 ++it) {
+                out.putStr(it->key, it->keyLength);
+                out.putStr(it->value, it->valueLength);
+            }
+        } else {
+            const ParsedParam &opt = options_[i];
+            out.putU32(static_cast<unsigned int>(opt.choice_));
+            out.putStr(opt.asString().data(), opt.asString().size());
+        }
+    }
+    for (size_t i = 0; i < rest_.size(); ++i) {
+        out.putStr(rest_[i], std::strlen(rest_[i]));
+    }
+    return out.size();
+}
+
+size_t CmdLineParams::writeJson(char *dst, size_t capacity) const {
+    // {"args":{"name":"val","1":"val"},"flags":{"-f":true},
+    //  "options":{"--opt":"val","--map":{"key":"val"},"--absent":null},
+    //  "rest":["val"]}
+    SnapshotWriter out(dst, capacity);
+    out.put("{\"args\":{");
+    for (size_t i = 0; i < arguments_.size(); ++i) {
+        if (i) {
+            out.put(',');
+        }
+        const char *name = pattern_->getName(arguments_[i].getArg());
+        if (*name) {
+            out.putJsonStr(name);
+        } else {
+            out.put('"');
+            out.putNumber(i);
+            out.put('"');
+        }
+        out.put(':');
+        out.putJsonStr(arguments_[i].asString().data(),
+                       arguments_[i].asString().size());
+    }
+    out.put("},\"flags\":{");
+    for (size_t i = 0; i < flags_.size(); ++i) {
+        if (i) {
+            out.put(',');
+        }
+        out.putJsonStr(pattern_->getName(pattern_->flags_[i]));
+        out.put(flags_[i] ? ":true" : ":false");
+    }
+    out.put("},\"options\":{");
+    for (size_t i = 0; i < options_.size(); ++i) {
+        if (i) {
+            out.put(',');
+        }
+        out.putJsonStr(pattern_->getName(pattern_->options_[i]));
+        out.put(':');
+        if (passedOptions_[i] && pattern_->options_[i].isMap()) {
+            const ParamMap &map = maps_[pattern_->options_[i].getMapSlot()];
+            out.put('{');
+            for (const ParamMap::Entry *it = map.begin(); it != map.end();
+                 ++it) {
+                if (it != map.begin()) {
+                    out.put(',');
+                }
+                out.putJsonStr(it->key, it->keyLength);
+                out.put(':');
+                out.putJsonStr(it->value, it->valueLength);
+            }
+            out.put('}');
+        } else if (passedOptions_[i]) {
+            out.putJsonStr(options_[i].asString().data(),
+                           options_[i].asString().size());
+        } else {
+            out.put("null");
+        }
+    }
+    out.put("},\"rest\":[");
+    for (size_t i = 0; i < rest_.size(); ++i) {
+        if (i) {
+            out.put(',');
+        }
+        out.putJsonStr(rest_[i]);
+    }
+    out.put("]}");
+    return out.size();
+}
+
+void CmdLineParams::readBinary(const char *src, size_t size) {
+    // Decoded into params sized for the current pattern, which replace
+    // these only if the whole snapshot is read.
+    CmdLineParams loaded(*pattern_);
+    SnapshotReader in(src, size);
+    if (0 != std::memcmp(in.take(sizeof(SnapshotMagic)), SnapshotMagic,
+                         sizeof(SnapshotMagic))) {
+        _THROW(Exception, "Not a params snapshot");
+    }
+    size_t argCount = in.takeU32();
+    size_t flagCount = in.takeU32();
+    size_t optCount = in.takeU32();
+    size_t restCount = in.takeU32();
+    if (argCount != pattern_->arguments_.size() ||
+        flagCount != pattern_->flags_.size() ||
+        optCount != pattern_->options_.size()) {
+        _THROW(Exception, "Params snapshot doesn't match the pattern");
+    }
+    in.takeBits(loaded.flags_);
+    in.takeBits(loaded.passedOptions_);
+
+    loaded.arguments_.reserve(argCount);
+    size_t length = 0;
+    for (size_t i = 0; i < argCount; ++i) {
+        const char *val = in.takeStr(length);
+        loaded.arguments_.push_back(ParsedArgParam(pattern_->arguments_[i],
+                                                   str_t(val, length)));
+    }
+    for (size_t i = 0; i < optCount; ++i) {
+        if (!loaded.passedOptions_[i]) {
+            continue;
+        }
+        const Option &option = pattern_->options_[i];
+        if (option.isMap()) {
+            // Entries point into the snapshot until they are copied below.
+            ParamMap &map = loaded.maps_[option.getMapSlot()];
+            for (size_t count = in.takeU32(); count; --count) {
+                const char *key = in.takeStr(length);
+                bool inserted = false;
+                ParamMap::Entry &entry = map.insert(key, length, inserted);
+                if (!inserted) {
+                    _THROW(Exception, "Corrupted params snapshot");
+                }
+                entry.value = in.takeStr(entry.valueLength);
+            }
+        } else {
+            int choice = static_cast<int>(in.takeU32());
+            const char *val = in.takeStr(length);
+            str_t value(val, length);
+            if (choice != pattern_->findChoice(option, value)) {
+                _THROW(Exception, "Corrupted params snapshot");
+            }
+            loaded.options_[i] = ParsedParam(value, choice);
+        }
+    }
+    // Rest args are copied with their terminators, only the pointers to
+    // them are rebuilt.
+    loaded.restArgv_.resize(restCount);
+    for (size_t i = 0; i < restCount; ++i) {
+        const char *val = in.takeStr(length);
+        loaded.restData_.append(val, length + 1);
+    }
+    if (!in.atEnd()) {
+        _THROW(Exception, "Corrupted params snapshot");
+    }
+    for (MapParams::const_iterator map = loaded.maps_.begin();
+         map != loaded.maps_.end(); ++map) {
+        for (const ParamMap::Entry *it = map->begin(); it != map->end();
+             ++it) {
+            loaded.mapData_.append(it->key, it->keyLength + 1);
+            loaded.mapData_.append(it->value, it->valueLength + 1);
+        }
+    }
+    loaded.rebindLoaded();
+    swap(loaded);
+}
+
+void CmdLineParams::rebindLoaded() CPPARSEOPT_NOEXCEPT {
+    if (!restArgv_.empty() && restData_.empty()) {
+        // Matched rest args interleaved with options, still in argv.
+        rest_ = ArgSpan(&restArgv_[0], restArgv_.size());
+    } else if (!restArgv_.empty()) {
+        char *it = &restData_[0];
+        for (size_t i = 0; i < restArgv_.size(); ++i) {
+            restArgv_[i] = it;
+            it += std::strlen(it) + 1;
+        }
+        rest_ = ArgSpan(&restArgv_[0], restArgv_.size());
+    }
+    if (!mapData_.empty()) {
+        // Walked by the lengths, the same way the entries were appended.
+        const char *it = mapData_.data();
+        for (MapParams::iterator map = maps_.begin(); map != maps_.end();
+             ++map) {
+            for (size_t i = 0; i < map->entries_.size(); ++i) {
+                ParamMap::Entry &entry = map->entries_[i];
+                entry.key = it;
+                it += entry.keyLength + 1;
+                entry.value = it;
+                it += entry.valueLength + 1;
+            }
+        }
+    }
 }
 
 
-ParsedArgParam::ParsedArgParam(const Argument &argument, const str_t &val)
-        : ParsedParam(val), argument_(argument) {
+#ifdef __GNUC__
+LiveParams::LiveParams(const Pattern &pattern, int argc, char **argv)
+        : pattern_(pattern), current_(0), epoch_(1) {
+    std::fill(readers_, readers_ + MaxReaders, 0ul);
+    CmdLineParams *params = new CmdLineParams(pattern_);
+    try {
+        pattern_.match(argc, argv, *params);
+    } catch (...) {
+        delete params;
+        throw;
+    }
+    current_ = params;
 }
 
-const Argument &ParsedArgParam::getArg() const {
-    return argument_;
+LiveParams::~LiveParams() {
+    for (size_t i = 0; i < retired_.size(); i++) {
+        delete retired_[i].params;
+    }
+    delete current_;
 }
 
+void LiveParams::reload(int argc, char **argv) {
+    // A failed match keeps the current snapshot.
+    CmdLineParams *params = new CmdLineParams(pattern_);
+    try {
+        pattern_.match(argc, argv, *params);
+    } catch (...) {
+        delete params;
+        throw;
+    }
 
-CmdLineParams::CmdLineParams(const Pattern &pattern)
-        : pattern_(pattern) {
+    Retired retired;
+    retired.params = __atomic_exchange_n(&current_, params, __ATOMIC_SEQ_CST);
+    // Readers seen this epoch or later can't hold the old snapshot.
+    retired.epoch = __atomic_add_fetch(&epoch_, 1, __ATOMIC_SEQ_CST);
+    retired_.push_back(retired);
+    reclaim();
 }
 
-bool CmdLineParams::ArgCmp::operator()(const Argument &lhs,
-                                       const Argument &rhs) const {
-    return lhs.getPos() < rhs.getPos();
+size_t LiveParams::pending() const {
+    return retired_.size();
 }
 
-bool CmdLineParams::FlagCmp::operator()(const Flag &lhs,
-                                        const Flag &rhs) const {
-    return lhs.getCanonicalName() < rhs.getCanonicalName();
+void LiveParams::reclaim() {
+    unsigned long oldest = __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < MaxReaders; i++) {
+        unsigned long seen = __atomic_load_n(&readers_[i], __ATOMIC_SEQ_CST);
+        if (seen && seen < oldest) {
+            oldest = seen;
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size(); i++) {
+        if (retired_[i].epoch <= oldest) {
+            delete retired_[i].params;
+        } else {
+            retired_[kept++] = retired_[i];
+        }
+    }
+    retired_.resize(kept);
 }
 
-const ParsedParam &CmdLineParams::getArg(const str_t &name) const {
-    const Argument &arg = getPattern().getArg(name);
-    return arguments_.find(arg)->second;
+
+LiveParams::Reader::Reader(LiveParams &live)
+        : live_(live), slot_(0) {
+    unsigned long epoch = __atomic_load_n(&live_.epoch_, __ATOMIC_SEQ_CST);
+    for (; slot_ < MaxReaders; slot_++) {
+        unsigned long expected = 0;
+        if (__atomic_compare_exchange_n(&live_.readers_[slot_], &expected,
+                                        epoch, false, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST)) {
+            return;
+        }
+    }
+    _THROW(Exception, "Too many LiveParams readers");
 }
 
-const ParsedParam &CmdLineParams::getArg(size_t pos) const {
-    return arguments_.find(getPattern().getArg(pos))->second;
+LiveParams::Reader::~Reader() {
+    __atomic_store_n(&live_.readers_[slot_], 0ul, __ATOMIC_SEQ_CST);
 }
 
-bool CmdLineParams::hasFlag(const str_t &name) const {
-    return flags_.find(getPattern().getFlag(name)) != flags_.end();
+const CmdLineParams &LiveParams::Reader::get() const {
+    return *__atomic_load_n(&live_.current_, __ATOMIC_ACQUIRE);
 }
 
-const Pattern &CmdLineParams::getPattern() const {
-    return pattern_;
+void LiveParams::Reader::quiescent() {
+    __atomic_store_n(&live_.readers_[slot_],
+                     __atomic_load_n(&live_.epoch_, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
 }
+#endif
 
 
 CmdLineParamsParser::CmdLineParamsParser()
-        : paramCounter_(0), argc_(0), argv_(0), params_(0) {
+        : argc_(0), argv_(0), paramCounter_(0), optionsEnded_(false),
+          restBegin_(0), restCount_(0), restSplit_(false), argCount_(0), pattern_(0), params_(0),
+          fields_(false) {
 }
 
-void CmdLineParamsParser::parse(int argc, char **argv, CmdLineParams &dst) {
-    reset(argc, argv, dst);
+void CmdLineParamsParser::parse(const Pattern &pattern, int argc, char **argv,
+                                CmdLineParams *dst, bool fields) {
+    reset(pattern, argc, argv, dst, fields);
 
     // На этом этапе нужно отловить все неожидаемые параметры и
     // все недопереданные параметры (т.е. те opts и args, для которых не заданы
     // default val в pattern).
     while (hasNextParam()) {
-        const char *param = nextParam();
-        if (isFlagParam(param)) {
-            parseFlag(param);
-            continue;
-        }
-
-        if (isOptParam(param)) {
-            parseOpt(param);
-            continue;
+        const Token &param = nextParam();
+        if (!optionsEnded_) {
+            if (2 == param.length && 2 == param.dashes) {
+                // "--" - the rest params are positional only.
+                optionsEnded_ = true;
+                continue;
+            }
+
+            if (isFlagParam(param)) {
+                parseFlag(param);
+                continue;
+            }
+
+            if (isOptParam(param)) {
+                parseOpt(param);
+                continue;
+            }
         }
 
         parseArg(param);
     }
+
+    finish();
 }
 
-const char *CmdLineParamsParser::currentParam() {
+const CmdLineParamsParser::Token &CmdLineParamsParser::currentParam() {
     if (paramCounter_ < argc_) {
-        return argv_[paramCounter_];
+        return tokens_[paramCounter_];
     }
     throw 1;  // TODO: ...
 }
@@ -478,44 +3269,356 @@ bool CmdLineParamsParser::hasNextParam() {
     return (paramCounter_ + 1 < argc_);
 }
 
-const char *CmdLineParamsParser::nextParam() {
+const CmdLineParamsParser::Token &CmdLineParamsParser::nextParam() {
     if (hasNextParam()) {
+        _STAT(tokens, 1);
         paramCounter_++;
         return currentParam();
     }
     throw 1;  // TODO: ...
 }
 
-bool CmdLineParamsParser::isFlagParam(const char *param) {
-    return '-' == param[0] && params_->getPattern().hasFlag(param);
+bool CmdLineParamsParser::isFlagParam(const Token &param) {
+    return param.dashes > 0 && param.validName && !param.hasValue
+           && pattern_->hasFlag(str_t(param.str, param.length));
+}
+
+bool CmdLineParamsParser::isOptParam(const Token &param) {
+    return param.dashes > 0 && param.validName
+           && pattern_->hasOpt(str_t(param.str, param.nameLength));
+}
+
+void CmdLineParamsParser::parseArg(const Token &param) {
+    size_t currentPos = argCount_;
+    const Pattern &pattern = *pattern_;
+    if (!pattern.hasArg(currentPos) && pattern.hasRest()) {
+        parseRest();
+        return;
+    }
+    const Argument &arg = pattern.getArg(currentPos);
+    argCount_++;
+    const Pattern::Binding *binding = pattern.findBinding(pattern.argSlots_,
+                                                          currentPos);
+    if (binding && binding->target.isBound()) {
+        _PHASE(PhaseConvert, convertNs);
+        binding->target.convert(str_t(param.str, param.length),
+                                addStore(binding->target, currentPos, true));
+    }
+    if (params_) {
+        // The value is built right in the params, without temporaries.
+        params_->arguments_.push_back(ParsedArgParam(arg));
+        params_->arguments_.back().val_.assign(param.str, param.length);
+    }
+}
+
+void CmdLineParamsParser::parseFlag(const Token &param) {
+    const Pattern &pattern = *pattern_;
+    size_t idx = pattern.getFlagHandle(str_t(param.str, param.length))
+                        .getIndex();
+    if (params_) {
+        params_->flags_[idx] = true;
+    }
+    markPresent(pattern.flags_[idx]);
+}
+
+void CmdLineParamsParser::parseOpt(const Token &param) {
+    // -o=val / --opt=val  - value is always taken from the param itself.
+    // -o / --opt          - default is used if provided, otherwise the
+    //                       next param is the value.
+    const str_t name(param.str, param.nameLength);
+    const Pattern &pattern = *pattern_;
+    size_t idx = pattern.getOptHandle(name).getIndex();
+    const Option &option = pattern.options_[idx];
+    if (option.isMap()) {
+        parseMapEntry(idx, name, param);
+        return;
+    }
+
+    str_t val;
+    bool isDefault = false;
+    if (param.hasValue) {
+        val.assign(param.str + param.nameLength + 1,
+                   param.length - param.nameLength - 1);
+    } else if (option.hasDefault()) {
+        isDefault = true;
+        val = pattern.getDefault(option);
+    } else if (hasNextParam()) {
+        const Token &next = nextParam();
+        val.assign(next.str, next.length);
+    } else {
+        _THROW(MissingParamException, "No value for option [" + name + "]");
+    }
+
+    // Defaults are validated and converted within the pattern already.
+    _PHASE(PhaseConvert, convertNs);
+    int choice = -1;
+    if (isDefault) {
+        choice = option.getDefaultChoice();
+    } else if (option.hasChoices()) {
+        choice = pattern.findChoice(option, val);
+        if (choice < 0) {
+            _THROW(BadValueException, "Bad value [" + val + "] for option "
+                                      "[" + name + "]");
+        }
+    }
+
+    size_t ordinal = option.getOrdinal();
+    const Pattern::Binding *binding = pattern.findBinding(pattern.slots_,
+                                                          ordinal);
+    if (binding && binding->target.isBound()) {
+        ParamBinding::Value &dst = addStore(binding->target, ordinal, false);
+        if (isDefault) {
+            storeDefault(*binding, val, dst);
+        } else if (choice >= 0 && binding->target.takesChoice()) {
+            binding->target.convertChoice(choice, dst);
+        } else {
+            binding->target.convert(val, dst);
+        }
+    }
+    if (params_) {
+        // The last occurrence of the option wins.
+        ParsedParam &dst = params_->options_[idx];
+        dst.val_.swap(val);
+        dst.choice_ = choice;
+        fallBack(isDefault ? binding : 0, dst);
+        params_->passedOptions_[idx] = true;
+    }
+    markPresent(option);
+}
+
+void CmdLineParamsParser::parseMapEntry(size_t idx, const str_t &name,
+                                        const Token &param) {
+    // --set key=value / --set=key=value. The entry points into argv.
+    const Option &option = pattern_->options_[idx];
+    const char *entry;
+    size_t length;
+    if (param.hasValue) {
+        entry = param.str + param.nameLength + 1;
+        length = param.length - param.nameLength - 1;
+    } else if (hasNextParam()) {
+        const Token &next = nextParam();
+        entry = next.str;
+        length = next.length;
+    } else {
+        _THROW(MissingParamException, "No value for option [" + name + "]");
+    }
+
+    const char *eq = static_cast<const char *>(std::memchr(entry, '=',
+                                                            length));
+    if (!eq || eq == entry) {
+        _THROW(BadValueException, "Bad value [" + str_t(entry, length) + "] "
+                                  "for option [" + name + "], key=value "
+                                  "expected");
+    }
+    size_t keyLength = eq - entry;
+    bool inserted = false;
+    CmdLineParams::MapParams &maps = params_ ? params_->maps_ : maps_;
+    ParamMap::Entry &dst = maps[option.getMapSlot()].insert(
+            entry, keyLength, inserted);
+    if (inserted || Option::LastWins == option.getDuplicateKeys()) {
+        dst.value = eq + 1;
+        dst.valueLength = length - keyLength - 1;
+    } else if (Option::RejectDuplicates == option.getDuplicateKeys()) {
+        _THROW(BadValueException, "Duplicate key [" + str_t(entry, keyLength) +
+                                  "] for option [" + name + "]");
+    }
+
+    if (params_) {
+        params_->passedOptions_[idx] = true;
+    }
+    markPresent(option);
+}
+
+void CmdLineParamsParser::parseRest() {
+    // Rest params are kept in argv. If flags/options are interleaved with
+    // them, the params collect pointers to them instead, so argv is never
+    // reordered.
+    const RestArguments &rest = pattern_->getRest();
+    if (restCount_ == rest.getMaxCount()) {
+        _THROW(UnknownParamException, "Too many rest arguments, at most "
+                                      "[" + toString(rest.getMaxCount()) +
+                                      "] expected");
+    }
+    if (0 == restCount_) {
+        restBegin_ = paramCounter_;
+    } else if (!restSplit_
+               && restBegin_ + static_cast<int>(restCount_) != paramCounter_) {
+        restSplit_ = true;
+        if (params_) {
+            std::vector<char *> &items = params_->restArgv_;
+            items.reserve(restCount_ + (argc_ - paramCounter_));
+            items.assign(argv_ + restBegin_, argv_ + restBegin_ + restCount_);
+        }
+    }
+    if (restSplit_ && params_) {
+        params_->restArgv_.push_back(argv_[paramCounter_]);
+    }
+    restCount_++;
 }
 
-bool CmdLineParamsParser::isOptParam(const char *param) {
-    return '-' == param[0] && params_->getPattern().hasOpt(param);
+void CmdLineParamsParser::finish() {
+    // Not passed arguments fall back to their defaults.
+    const Pattern &pattern = *pattern_;
+    for (size_t pos = argCount_; pattern.hasArg(pos); pos++) {
+        const Argument &arg = pattern.getArg(pos);
+        if (!arg.hasDefault()) {
+            _THROW(MissingParamException, "No value for argument at position "
+                                          "[" + toString(pos) + "]");
+        }
+        const Pattern::Binding *binding = pattern.findBinding(
+                pattern.argSlots_, pos);
+        if (!binding && !params_) {
+            continue;
+        }
+        const str_t val = pattern.getDefault(arg);
+        if (binding && binding->target.isBound()) {
+            storeDefault(*binding, val, addStore(binding->target, pos, true));
+        }
+        if (params_) {
+            params_->arguments_.push_back(ParsedArgParam(arg, val));
+            fallBack(binding, params_->arguments_.back());
+        }
+    }
+
+    if (pattern.hasRest()) {
+        const RestArguments &rest = pattern.getRest();
+        if (restCount_ < rest.getMinCount()) {
+            _THROW(MissingParamException, "Too few rest arguments, at least "
+                                          "[" + toString(rest.getMinCount()) +
+                                          "] expected");
+        }
+        if (restCount_ && params_) {
+            params_->rest_ = restSplit_
+                    ? ArgSpan(&params_->restArgv_[0], restCount_)
+                    : ArgSpan(argv_ + restBegin_, restCount_);
+        }
+    }
+
+    pattern.checkConstraints(presence_);
+
+    // Bound flags always receive their presence state.
+    for (size_t i = 0; i < pattern.flags_.size(); i++) {
+        size_t ordinal = pattern.flags_[i].getOrdinal();
+        const Pattern::Binding *binding = pattern.findBinding(pattern.slots_,
+                                                              ordinal);
+        if (binding && binding->target.isBound()) {
+            addStore(binding->target, ordinal, false).num.b =
+                    0 != (presence_[ordinal / PresenceBits]
+                          & Pattern::PresenceWord(1) << (ordinal % PresenceBits));
+        }
+    }
+    // Bound variables are written only by a successful match, and only
+    // once every target resolves, in the order of the values, so the last
+    // occurrence of an option wins.
+    if (!fields_) {
+        for (size_t i = 0; i < stores_.size(); i++) {
+            if (stores_[i].binding->isField()) {
+                _THROW(Exception, "Param is bound to a struct field. "
+                                  "Use PatternFor<T>::match()");
+            }
+        }
+    }
+    for (size_t i = 0; i < stores_.size(); i++) {
+        if (!stores_[i].binding->isField()) {
+            stores_[i].binding->store(stores_[i].value);
+        }
+    }
 }
 
-void CmdLineParamsParser::parseArg(const char *param) {
-    size_t currentPos = params_->arguments_.size();
-    const Argument &arg = params_->getPattern().getArg(currentPos);
-    params_->arguments_.insert(
-            CmdLineParams::ArgParamsItem(arg, ParsedArgParam(arg, param))
-    );
+void CmdLineParamsParser::markPresent(const ParamAliased &param) {
+    presence_[param.getOrdinal() / PresenceBits] |=
+            Pattern::PresenceWord(1) << (param.getOrdinal() % PresenceBits);
 }
 
-void CmdLineParamsParser::parseFlag(const char *param) {
-    const Flag &flag = params_->getPattern().getFlag(param);
-    params_->flags_.insert(CmdLineParams::FlagParamsItem(flag, true));
+void CmdLineParamsParser::storeDefault(const Pattern::Binding &binding,
+                                       const str_t &val,
+                                       ParamBinding::Value &dst) {
+    dst.num = binding.value;
+    if (binding.target.takesString()) {
+        dst.str = val;
+    }
 }
 
-void CmdLineParamsParser::parseOpt(const char *param) {
+void CmdLineParamsParser::fallBack(const Pattern::Binding *binding,
+                                   ParsedParam &dst) {
+    // The last occurrence may reuse a param which fell back before.
+    dst.defaultType_ = binding ? binding->type : DefaultValue::String;
+    if (binding) {
+        dst.default_ = binding->fallback;
+    }
+}
 
+ParamBinding::Value &CmdLineParamsParser::addStore(
+        const ParamBinding &binding, size_t slot, bool arg) {
+    stores_.push_back(PendingStore());
+    stores_.back().binding = &binding;
+    stores_.back().slot = slot;
+    stores_.back().arg = arg;
+    return stores_.back().value;
+}
+
+void CmdLineParamsParser::classify(const char *param, Token &dst) {
+    size_t eqPos, badPos;
+    scanToken(param, dst.length, eqPos, badPos);
+    dst.str = param;
+    dst.hasValue = str_t::npos != eqPos;
+    dst.nameLength = dst.hasValue ? eqPos : dst.length;
+    dst.validName = dst.nameLength > 0 && badPos >= dst.nameLength;
+    for (dst.dashes = 0; dst.dashes < dst.length
+                         && '-' == param[dst.dashes]; dst.dashes++) {
+    }
 }
 
-void CmdLineParamsParser::reset(int argc, char **argv, CmdLineParams &dst) {
+void CmdLineParamsParser::reset(const Pattern &pattern, int argc, char **argv,
+                                CmdLineParams *dst, bool fields) {
     argc_ = argc;
     argv_ = argv;
-    params_ = &dst;
+    pattern_ = &pattern;
+    params_ = dst;
+    fields_ = fields;
     paramCounter_ = 0;
+    optionsEnded_ = false;
+    restBegin_ = 0;
+    restCount_ = 0;
+    restSplit_ = false;
+    argCount_ = 0;
+    stores_.clear();
+    size_t count = argc > 0 ? argc : 0;
+    if (tokens_.capacity() < count) {
+        _STAT(allocations, 1);
+    }
+    tokens_.resize(count);
+    {
+        _PHASE(PhaseClassify, classifyNs);
+        for (size_t i = 0; i < count; i++) {
+            classify(argv[i], tokens_[i]);
+        }
+    }
+    presence_.assign(pattern.ordinals_ / PresenceBits + 1, 0);
+    if (!params_) {
+        maps_.resize(pattern.mapCount_);
+        for (size_t i = 0; i < maps_.size(); i++) {
+            maps_[i].clear();
+        }
+        return;
+    }
+    params_->arguments_.clear();
+    if (params_->arguments_.capacity() < pattern.arguments_.size()) {
+        _STAT(allocations, 1);
+        params_->arguments_.reserve(pattern.arguments_.size());
+    }
+    params_->flags_.assign(pattern.flags_.size(), false);
+    params_->options_.assign(pattern.options_.size(), ParsedParam());
+    params_->passedOptions_.assign(pattern.options_.size(), false);
+    // Maps keep their storage for the next match.
+    params_->maps_.resize(pattern.mapCount_);
+    for (size_t i = 0; i < params_->maps_.size(); i++) {
+        params_->maps_[i].clear();
+    }
+    params_->rest_ = ArgSpan();
+    params_->restData_.clear();
+    params_->restArgv_.clear();
+    params_->mapData_.clear();
 }
 
 
@@ -529,7 +3632,7 @@ Exception::Exception(const std::string &msg, const char *file, size_t line)
 
 std::string Exception::makeMsg(const std::string &msg, const char *file,
                            size_t line) {
-    return msg + "\n    " + file + ":" + std::to_string(line);
+    return msg + "\n    " + file + ":" + toString(line);
 }
 
 
@@ -551,3 +3654,34 @@ UnknownParamException::UnknownParamException(const std::string &msg,
                                              const char *file, size_t line)
         : Exception(msg, file, line) {
 }
+
+
+MissingParamException::MissingParamException(const std::string &msg)
+        : Exception(msg) {
+}
+
+MissingParamException::MissingParamException(const std::string &msg,
+                                             const char *file, size_t line)
+        : Exception(msg, file, line) {
+}
+
+
+BadValueException::BadValueException(const std::string &msg)
+        : Exception(msg) {
+}
+
+BadValueException::BadValueException(const std::string &msg,
+                                     const char *file, size_t line)
+        : Exception(msg, file, line) {
+}
+
+
+ConflictingParamsException::ConflictingParamsException(const std::string &msg)
+        : Exception(msg) {
+}
+
+ConflictingParamsException::ConflictingParamsException(const std::string &msg,
+                                                       const char *file,
+                                                       size_t line)
+        : Exception(msg, file, line) {
+}
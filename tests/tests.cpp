@@ -1,5 +1,15 @@
 #include "../include/cpparseopt.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <utility>
+#include <vector>
+#ifdef __GNUC__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #define STOP_ON_ERR 0
 
@@ -11,12 +21,14 @@
         try {                                                                  \
             (expression);                                                      \
             if (throws) {                                                      \
+                failures++;                                                    \
                 std::cout << "An exception was not thrown at "                 \
                           << __FILE__ << ":" << __LINE__                       \
                           << ". " << message << std::endl;                     \
             }                                                                  \
         } catch(const ET &e) {                                                 \
             if (!throws) {                                                     \
+                failures++;                                                    \
                 std::cout << "Unexpected exception at "                        \
                           << __FILE__ << ":" << __LINE__                       \
                           << " [" << e.what() << "]"                           \
@@ -34,11 +46,14 @@ using namespace cpparseopt;
 
 
 // =============================== begin: Utils ===============================+
+static int failures = 0;
+
 template<typename T>
 void assertEquals(const T &expected, const T &actual, bool stopOnFailure,
                   const char *file, size_t line) {
     bool ok = (expected == actual);
     if (!ok) {
+        failures++;
         std::cout << "Assertion failed: [" <<
                 expected << "] != [" << actual << "]" << std::endl <<
                 "    on " << file << ":" << line << std::endl;
@@ -68,7 +83,7 @@ void Test__PatternBuilder__SimpleArg() {
 
     ASSERT(&argByPos == &argByName);
     ASSERT_EQ(pos, argByPos.getPos());
-    ASSERT(argByPos.hasName("arg"));
+    ASSERT_EQ(str_t("arg"), str_t(pattern.getName(argByPos)));
     ASSERT(!argByPos.hasDefault());
 }
 
@@ -106,12 +121,89 @@ void Test__PatternBuilder__NameFormats() {
     }
 }
 
+void Test__PatternBuilder__Choices() {
+    Pattern pattern;
+    ASSERT_THROWS(PatternBuilder(pattern).opt("--mode").choices("fast||safe"),
+                  BadValueException);
+    ASSERT_THROWS(PatternBuilder(pattern).opt("--codec").choices("lz4|lz4"),
+                  BadValueException);
+    ASSERT_THROWS(PatternBuilder(pattern).opt("--level")
+                          .choices("low|high").defaultVal("medium"),
+                  BadValueException);
+
+    PatternBuilder(pattern).opt("--color").choices("red|green|blue|cyan|"
+                                                   "magenta|yellow|black");
+    const Option &option = pattern.getOpt("--color");
+    ASSERT_EQ(0, pattern.findChoice(option, "red"));
+    ASSERT_EQ(4, pattern.findChoice(option, "magenta"));
+    ASSERT_EQ(6, pattern.findChoice(option, "black"));
+    ASSERT_EQ(-1, pattern.findChoice(option, "white"));
+    ASSERT_EQ(-1, pattern.findChoice(option, "re"));
+}
+
+void Test__PatternBuilder__Table() {
+    static const ParamDescr params[] = {
+        {ParamDescr::ArgParam,  "input", 0, "Input file"},
+        {ParamDescr::ArgParam,  0, "out.txt", 0},
+        {ParamDescr::OptParam,  "-t|--threads", "4", "Worker threads"},
+        {ParamDescr::OptParam,  "--db.pool.size", 0, 0},
+        {ParamDescr::FlagParam, "-v|--verbose", 0, "Verbose output"},
+    };
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .opt("--db.host")
+            .table(params)
+            .flag("-q");
+    ASSERT_EQ(str_t("Input file"), pattern.getDescr(pattern.getArg("input")));
+    ASSERT_EQ(str_t(""), str_t(pattern.getName(pattern.getArg(1))));
+    ASSERT_EQ(str_t("out.txt"), pattern.getDefault(pattern.getArg(1)));
+    ASSERT(&pattern.getOpt("--threads") == &pattern.getOpt("-t"));
+    ASSERT_EQ(str_t("4"), pattern.getDefault(pattern.getOpt("-t")));
+    ASSERT(!pattern.getOpt("--db.pool.size").hasDefault());
+    ASSERT_EQ(str_t("Verbose output"),
+              pattern.getDescr(pattern.getFlag("-v")));
+    ASSERT(pattern.hasFlag("-q"));
+
+    const char *argv[] = {"/path/to/bin", "in", "--db.pool.size=8", "-t",
+                          "--verbose"};
+    CmdLineParams parsed = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                          const_cast<char **>(argv));
+    ASSERT_EQ(str_t("out.txt"), parsed.getArg(1).asString());
+    ASSERT_EQ(4, parsed.getOpt("--threads").asInt());
+    ASSERT(parsed.hasFlag("-v"));
+    ParamGroup db = parsed.group("--db");
+    ASSERT_EQ(static_cast<size_t>(2), db.size());
+    ASSERT_EQ(str_t("--db.host"), str_t(db.getName(0)));
+    ASSERT_EQ(str_t("8"), db.get(1).asString());
+
+    // A bad row leaves the pattern untouched.
+    static const ParamDescr bad[][2] = {
+        {{ParamDescr::FlagParam, "-x", 0, 0},
+         {ParamDescr::FlagParam, "-v|verbose", 0, 0}},
+        {{ParamDescr::FlagParam, "-x", 0, 0},
+         {ParamDescr::OptParam, "--o|", 0, 0}},
+        {{ParamDescr::FlagParam, "-x", 0, 0},
+         {ParamDescr::ArgParam, "a|b", 0, 0}},
+        {{ParamDescr::FlagParam, "-x", 0, 0},
+         {ParamDescr::OptParam, "--a=b", 0, 0}},
+        {{ParamDescr::FlagParam, "-x", 0, 0},
+         {ParamDescr::FlagParam, 0, 0, 0}},
+    };
+    for (size_t i = 0; i < sizeOfArray(bad); ++i) {
+        ASSERT_THROWS(PatternBuilder(pattern).table(bad[i]),
+                      BadNameException);
+    }
+    ASSERT(!pattern.hasFlag("-x"));
+}
+
 void TestSuite__PatternBuilder() {
     std::cout << "Test Suite: PatternBuilder" << std::endl;
 
     Test__PatternBuilder__SimpleArg();
     Test__PatternBuilder__AnonymousArg();
     Test__PatternBuilder__NameFormats();
+    Test__PatternBuilder__Choices();
+    Test__PatternBuilder__Table();
 
     std::cout << std::endl;
 }
@@ -182,11 +274,1224 @@ void Test__Parser__SimpleOptions() {
     ASSERT(false);
 }
 
+void Test__Parser__Binding() {
+    str_t input;
+    int threads = 0;
+    double ratio = 0;
+    unsigned long limit = 0;
+    bool verbose = true;
+    bool quiet = false;
+
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("input").bindTo(&input)
+            .arg("ratio").bindTo(&ratio).defaultVal("0.5")
+            .opt("-t").bindTo(&threads).alias("--threads")
+            .opt("--limit").bindTo(&limit).defaultVal("100")
+            .flag("-v").bindTo(&verbose)
+            .flag("-q").bindTo(&quiet);
+
+    const char *argv[] = {"/path/to/bin", "file.txt", "--threads", "8",
+                          "--limit", "-q"};
+    pattern.match(static_cast<int>(sizeOfArray(argv)),
+                  const_cast<char **>(argv));
+
+    ASSERT_EQ(str_t("file.txt"), input);
+    ASSERT_EQ(0.5, ratio);
+    ASSERT_EQ(8, threads);
+    ASSERT_EQ(100ul, limit);
+    ASSERT_EQ(false, verbose);
+    ASSERT_EQ(true, quiet);
+
+    const char *argv2[] = {"/path/to/bin", "file.txt", "-t=x"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv2)),
+                                const_cast<char **>(argv2)),
+                  BadValueException);
+
+    const char *argv3[] = {"/path/to/bin"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv3)),
+                                const_cast<char **>(argv3)),
+                  MissingParamException);
+
+    // A failed match leaves the variables as they were.
+    const char *argv4[] = {"/path/to/bin", "-t", "9", "--limit=5", "-v"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv4)),
+                                const_cast<char **>(argv4)),
+                  MissingParamException);
+    const char *argv5[] = {"/path/to/bin", "other.txt", "1.5", "-t=9", "-v",
+                           "--limit=x"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv5)),
+                                const_cast<char **>(argv5)),
+                  BadValueException);
+    PatternBuilder(pattern).conflicts("-q", "-v");
+    const char *argv6[] = {"/path/to/bin", "other.txt", "-t=9", "-v", "-q"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv6)),
+                                const_cast<char **>(argv6)),
+                  ConflictingParamsException);
+    ASSERT_EQ(str_t("file.txt"), input);
+    ASSERT_EQ(0.5, ratio);
+    ASSERT_EQ(8, threads);
+    ASSERT_EQ(100ul, limit);
+    ASSERT_EQ(false, verbose);
+    ASSERT_EQ(true, quiet);
+}
+
+struct BindingConfig {
+    str_t input;
+    int threads;
+    double ratio;
+    bool verbose;
+
+    BindingConfig() : threads(0), ratio(0), verbose(false) {}
+};
+
+void Test__Parser__StructBinding() {
+    PatternFor<BindingConfig> pattern;
+    pattern.arg("input", &BindingConfig::input);
+    pattern.opt("--threads", &BindingConfig::threads).alias("-t");
+    pattern.opt("--ratio", &BindingConfig::ratio).defaultVal("0.25");
+    pattern.flag("-v", &BindingConfig::verbose);
+
+    const char *argv[] = {"/path/to/bin", "file.txt", "-t", "16",
+                          "--ratio", "-v"};
+    BindingConfig config;
+    pattern.match(static_cast<int>(sizeOfArray(argv)),
+                  const_cast<char **>(argv), config);
+
+    ASSERT_EQ(str_t("file.txt"), config.input);
+    ASSERT_EQ(16, config.threads);
+    ASSERT_EQ(0.25, config.ratio);
+    ASSERT_EQ(true, config.verbose);
+
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                const_cast<char **>(argv)),
+                  Exception);
+
+    // Matched without an object, nothing is written, plain variables
+    // included.
+    int plain = 0;
+    PatternBuilder(pattern).opt("--plain").bindTo(&plain);
+    const char *argv2[] = {"/path/to/bin", "--plain=5", "file.txt"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv2)),
+                                const_cast<char **>(argv2)),
+                  Exception);
+    ASSERT_EQ(0, plain);
+
+    // Flags take their presence state, nothing but bool can hold it.
+    ASSERT_THROWS(PatternBuilder(pattern).flag("-q").bindTo(
+                          ParamBinding(&plain)),
+                  BadValueException);
+}
+
+struct FixedConfig {
+    // No default constructor.
+    long limit;
+    bool dryRun;
+
+    explicit FixedConfig(long limit) : limit(limit), dryRun(false) {}
+};
+
+void Test__Parser__StructBindingFields() {
+    PatternFor<FixedConfig> *pattern = new PatternFor<FixedConfig>();
+    pattern->opt("--limit", &FixedConfig::limit);
+    pattern->flag("-n", &FixedConfig::dryRun);
+    PatternBuilder(*pattern).opt("--set").map(Option::RejectDuplicates);
+    PatternFor<FixedConfig> copy(*pattern);
+    delete pattern;
+
+    const char *argv[] = {"/path/to/bin", "-n", "--limit=7", "--set", "a=1"};
+    FixedConfig config(1);
+    copy.match(static_cast<int>(sizeOfArray(argv)),
+               const_cast<char **>(argv), config);
+    ASSERT_EQ(7l, config.limit);
+    ASSERT_EQ(true, config.dryRun);
+
+    // Map entries are checked even without params to keep them.
+    const char *argv2[] = {"/path/to/bin", "--set", "a=1", "--set", "a=2"};
+    ASSERT_THROWS(copy.match(static_cast<int>(sizeOfArray(argv2)),
+                             const_cast<char **>(argv2), config),
+                  BadValueException);
+}
+
+void Test__Parser__TokenClassification() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("arg0").arg("arg1").arg("arg2").arg("arg3")
+            .opt("--a-rather-long-option-name-jjj")
+            .opt("-o")
+            .flag("--a-rather-long-flag-name-over-16-bytes");
+
+    const char *argv[] = {"/path/to/bin",
+                          "--a-rather-long-option-name-jjj=value=with=eq",
+                          "--a-rather-long-flag-name-over-16-bytes",
+                          "-o=",
+                          "-",
+                          "--a-rather-long-flag-name-over-16-bytes=x",
+                          "--not an option",
+                          "plain"};
+    CmdLineParams params = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+
+    ASSERT_EQ(str_t("value=with=eq"),
+              params.getOpt("--a-rather-long-option-name-jjj").asString());
+    ASSERT(params.hasFlag("--a-rather-long-flag-name-over-16-bytes"));
+    ASSERT_EQ(str_t(""), params.getOpt("-o").asString());
+    ASSERT_EQ(str_t("-"), params.getArg(0).asString());
+    ASSERT_EQ(str_t("--a-rather-long-flag-name-over-16-bytes=x"),
+              params.getArg(1).asString());
+    ASSERT_EQ(str_t("--not an option"), params.getArg(2).asString());
+    ASSERT_EQ(str_t("plain"), params.getArg(3).asString());
+
+    // '=' and bad symbols around the 16-byte chunk boundaries.
+    Pattern chunks;
+    PatternBuilder(chunks)
+            .arg("arg0").arg("arg1").arg("arg2")
+            .opt("--option-15-long").opt("--option-16-longer")
+            .flag("--flag-is-17-long");
+    const char *argv2[] = {"/path/to/bin",
+                           "--option-15-long=a b",
+                           "--option-16-longer=",
+                           "--flag-is-17-long",
+                           "--option-15-lon!=x",
+                           "--flag-is-17-lon$",
+                           "--option-16-longer!"};
+    params = chunks.match(static_cast<int>(sizeOfArray(argv2)),
+                          const_cast<char **>(argv2));
+    ASSERT_EQ(str_t("a b"), params.getOpt("--option-15-long").asString());
+    ASSERT_EQ(str_t(""), params.getOpt("--option-16-longer").asString());
+    ASSERT(params.hasFlag("--flag-is-17-long"));
+    ASSERT_EQ(str_t("--option-15-lon!=x"), params.getArg(0).asString());
+    ASSERT_EQ(str_t("--flag-is-17-lon$"), params.getArg(1).asString());
+    ASSERT_EQ(str_t("--option-16-longer!"), params.getArg(2).asString());
+}
+
+void Test__Parser__Choices() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .opt("--mode").choices("fast|safe|debug").defaultVal("safe")
+            .opt("--codec").choices("lz4|zstd|none");
+
+    const char *argv[] = {"/path/to/bin", "--mode", "--codec", "zstd"};
+    CmdLineParams params = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+    ASSERT_EQ(1, params.getOpt("--mode").asChoice());
+    ASSERT_EQ(1, params.getOpt("--codec").asChoice());
+    ASSERT_EQ(str_t("zstd"), params.getOpt("--codec").asString());
+
+    const char *argv2[] = {"/path/to/bin", "--codec=gzip"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv2)),
+                                const_cast<char **>(argv2)),
+                  BadValueException);
+}
+
+enum Mode { ModeFast, ModeSafe, ModeDebug };
+
+struct ChoiceConfig {
+    int mode;
+
+    ChoiceConfig() : mode(-1) {}
+};
+
+void Test__Parser__BoundChoices() {
+    int mode = -1;
+    unsigned long level = 0;
+    str_t codec;
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .opt("--mode").choices("fast|safe|debug").bindTo(&mode)
+            .defaultVal("debug")
+            .opt("--level").bindTo(&level).choices("low|high")
+            .opt("--codec").choices("lz4|zstd").bindTo(&codec);
+
+    const char *argv[] = {"/path/to/bin", "--mode=safe", "--level", "high",
+                          "--codec=zstd"};
+    pattern.match(static_cast<int>(sizeOfArray(argv)),
+                  const_cast<char **>(argv));
+    ASSERT_EQ(ModeSafe, static_cast<Mode>(mode));
+    ASSERT_EQ(1ul, level);
+    ASSERT_EQ(str_t("zstd"), codec);
+
+    const char *argv2[] = {"/path/to/bin", "--mode"};
+    pattern.match(static_cast<int>(sizeOfArray(argv2)),
+                  const_cast<char **>(argv2));
+    ASSERT_EQ(ModeDebug, static_cast<Mode>(mode));
+
+    PatternFor<ChoiceConfig> bound;
+    bound.opt("--mode", &ChoiceConfig::mode).choices("fast|safe")
+            .defaultVal("fast");
+    ChoiceConfig config;
+    const char *argv3[] = {"/path/to/bin", "--mode=safe"};
+    bound.match(static_cast<int>(sizeOfArray(argv3)),
+                const_cast<char **>(argv3), config);
+    ASSERT_EQ(ModeSafe, static_cast<Mode>(config.mode));
+}
+
+void Test__Parser__TypedDefaults() {
+    int count = 0;
+    double ratio = 0;
+    bool enabled = false;
+    str_t name;
+
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("count").bindTo(&count).defaultVal(42)
+            .arg("name").bindTo(&name).defaultVal("anonymous")
+            .opt("--ratio").bindTo(&ratio).defaultVal(0.1)
+            .opt("--enabled").bindTo(&enabled).defaultVal(true);
+
+    const char *argv[] = {"/path/to/bin", "--ratio", "--enabled"};
+    CmdLineParams params = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+    ASSERT_EQ(42, count);
+    ASSERT_EQ(str_t("anonymous"), name);
+    ASSERT_EQ(0.1, ratio);
+    ASSERT_EQ(true, enabled);
+    ASSERT_EQ(str_t("0.1"), params.getOpt("--ratio").asString());
+    ASSERT_EQ(42, params.getArg("count").asInt());
+
+    // Malformed defaults fail at pattern construction.
+    int threads = 0;
+    ASSERT_THROWS(PatternBuilder(pattern)
+                          .opt("--threads").bindTo(&threads).defaultVal("x"),
+                  BadValueException);
+    PatternFor<BindingConfig> bound;
+    ASSERT_THROWS(bound.opt("--ratio2", &BindingConfig::ratio)
+                          .defaultVal("half"),
+                  BadValueException);
+    // Typed defaults are validated whether bound or not.
+    ASSERT_THROWS(PatternBuilder(pattern).opt("--retries")
+                          .defaultVal(DefaultValue(DefaultValue::Int, "abc")),
+                  BadValueException);
+    ASSERT_THROWS(PatternBuilder(pattern).arg("scale")
+                          .defaultVal(DefaultValue(DefaultValue::Double, "")),
+                  BadValueException);
+
+    // Fallbacks carry the converted default of the pattern.
+    Pattern unbound;
+    PatternBuilder(unbound)
+            .arg("count").defaultVal(DefaultValue(DefaultValue::Int, "7"))
+            .opt("--ratio").defaultVal(0.75)
+            .opt("--name").defaultVal("x");
+    const char *argv2[] = {"/path/to/bin", "--ratio", "--name=y"};
+    CmdLineParams fallback = unbound.match(
+            static_cast<int>(sizeOfArray(argv2)), const_cast<char **>(argv2));
+    ASSERT_EQ(7, fallback.getArg("count").asInt());
+    ASSERT_EQ(7.0, fallback.getArg("count").asDouble());
+    ASSERT_EQ(str_t("7"), fallback.getArg("count").asString());
+    ASSERT_EQ(0.75, fallback.getOpt("--ratio").asDouble());
+    ASSERT_EQ(str_t("0.75"), fallback.getOpt("--ratio").asString());
+    ASSERT_EQ(str_t("y"), fallback.getOpt("--name").asString());
+    CmdLineParams copy(fallback);
+    ASSERT_EQ(0.75, copy.getOpt("--ratio").asDouble());
+
+    // A later passed value replaces the fallback.
+    const char *argv3[] = {"/path/to/bin", "--ratio", "--ratio=0.5"};
+    CmdLineParams passed = unbound.match(
+            static_cast<int>(sizeOfArray(argv3)), const_cast<char **>(argv3));
+    ASSERT_EQ(0.5, passed.getOpt("--ratio").asDouble());
+}
+
+void Test__Parser__RestArgs() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("cmd")
+            .flag("-v")
+            .rest("files").count(1, 4);
+
+    const char *argv[] = {"/path/to/bin", "cmd", "a", "-v", "b", "--",
+                          "-v", "c"};
+    CmdLineParams params = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+    const ArgSpan &rest = params.getRest();
+    ASSERT_EQ(static_cast<size_t>(4), rest.size());
+    ASSERT_EQ(str_t("a"), str_t(rest[0]));
+    ASSERT_EQ(str_t("b"), str_t(rest[1]));
+    ASSERT_EQ(str_t("-v"), str_t(rest[2]));
+    ASSERT_EQ(str_t("c"), str_t(rest[3]));
+    ASSERT(params.hasFlag("-v"));
+    // argv is left as it was; the items are not copied.
+    ASSERT_EQ(str_t("-v"), str_t(argv[3]));
+    ASSERT_EQ(str_t("b"), str_t(argv[4]));
+    ASSERT(rest[1] == argv[4]);
+    CmdLineParams copy(params);
+    params = CmdLineParams(pattern);
+    ASSERT_EQ(static_cast<size_t>(4), copy.getRest().size());
+    ASSERT_EQ(str_t("c"), str_t(copy.getRest()[3]));
+
+    // Contiguous rest args: the span points into argv.
+    const char *plain[] = {"/path/to/bin", "-v", "cmd", "a", "b"};
+    params = pattern.match(static_cast<int>(sizeOfArray(plain)),
+                           const_cast<char **>(plain));
+    ASSERT(params.getRest().begin() == const_cast<char **>(plain) + 3);
+    ASSERT_EQ(static_cast<size_t>(2), params.getRest().size());
+
+    // A failed match doesn't touch argv either.
+    const char *failed[] = {"/path/to/bin", "cmd", "a", "-v", "b", "c", "d",
+                            "e"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(failed)),
+                                const_cast<char **>(failed)),
+                  UnknownParamException);
+    ASSERT_EQ(str_t("-v"), str_t(failed[3]));
+
+    const char *argv2[] = {"/path/to/bin", "cmd"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv2)),
+                                const_cast<char **>(argv2)),
+                  MissingParamException);
+
+    const char *argv3[] = {"/path/to/bin", "cmd", "a", "b", "c", "d", "e"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(argv3)),
+                                const_cast<char **>(argv3)),
+                  UnknownParamException);
+
+    ASSERT_THROWS(PatternBuilder(pattern).rest(), Exception);
+}
+
+void Test__Parser__ManyRestArgs() {
+    Pattern pattern;
+    PatternBuilder(pattern).flag("-0").rest();
+
+    std::vector<char *> argv(100001, const_cast<char *>("path"));
+    argv[0] = const_cast<char *>("/path/to/bin");
+    argv[50000] = const_cast<char *>("-0");
+    CmdLineParams params = pattern.match(static_cast<int>(argv.size()),
+                                         &argv[0]);
+    ASSERT_EQ(static_cast<size_t>(99999), params.getRest().size());
+    ASSERT(params.hasFlag("-0"));
+}
+
+CPPARSEOPT_OPT(int, registeredThreads, "--registered-threads", 4, "Threads");
+CPPARSEOPT_OPT(str_t, registeredName, "--registered-name", "none", "");
+CPPARSEOPT_FLAG(registeredVerbose, "--registered-verbose", "Verbose");
+
+void Test__Parser__RegisteredOptions() {
+    Pattern pattern;
+    PatternBuilder(pattern).arg("arg").registered();
+
+    ASSERT(pattern.hasOpt("--registered-threads"));
+    ASSERT_EQ(str_t("Threads"),
+              pattern.getDescr(pattern.getOpt("--registered-threads")));
+
+    const char *argv[] = {"/path/to/bin", "--registered-verbose",
+                          "--registered-threads=16", "arg"};
+    pattern.match(static_cast<int>(sizeOfArray(argv)),
+                  const_cast<char **>(argv));
+    ASSERT_EQ(16, registeredThreads);
+    ASSERT_EQ(16, atomicLoad(registeredThreads));
+    ASSERT_EQ(str_t("none"), registeredName);
+    ASSERT_EQ(true, registeredVerbose);
+
+    // Nothing was registered since, so nothing is added again.
+    PatternBuilder(pattern).registered().opt("--after-registered");
+    ASSERT_EQ(static_cast<size_t>(2),
+              pattern.getOptHandle("--after-registered").getIndex());
+    Pattern copy(pattern);
+    PatternBuilder(copy).registered().flag("--after-copy");
+    ASSERT_EQ(static_cast<size_t>(1),
+              copy.getFlagHandle("--after-copy").getIndex());
+}
+
+#ifdef __GNUC__
+void Test__Parser__LiveParams() {
+    Pattern pattern;
+    PatternBuilder(pattern).opt("--limit");
+
+    const char *argv[] = {"/path/to/bin", "--limit=10"};
+    LiveParams live(pattern, static_cast<int>(sizeOfArray(argv)),
+                    const_cast<char **>(argv));
+    LiveParams::Reader reader(live);
+    const CmdLineParams &before = reader.get();
+    ASSERT_EQ(10, before.getOpt("--limit").asInt());
+
+    const char *argv2[] = {"/path/to/bin", "--limit=20"};
+    live.reload(static_cast<int>(sizeOfArray(argv2)),
+                const_cast<char **>(argv2));
+    // The reader hasn't passed a quiescent state, the old snapshot is alive.
+    ASSERT_EQ(static_cast<size_t>(1), live.pending());
+    ASSERT_EQ(10, before.getOpt("--limit").asInt());
+    ASSERT_EQ(20, reader.get().getOpt("--limit").asInt());
+
+    const char *argv3[] = {"/path/to/bin", "--limit"};
+    ASSERT_THROWS(live.reload(static_cast<int>(sizeOfArray(argv3)),
+                              const_cast<char **>(argv3)),
+                  MissingParamException);
+    ASSERT_EQ(20, reader.get().getOpt("--limit").asInt());
+
+    reader.quiescent();
+    const char *argv4[] = {"/path/to/bin", "--limit=30"};
+    live.reload(static_cast<int>(sizeOfArray(argv4)),
+                const_cast<char **>(argv4));
+    ASSERT_EQ(static_cast<size_t>(1), live.pending());
+    ASSERT_EQ(30, reader.get().getOpt("--limit").asInt());
+}
+
+struct LiveReaderState {
+    LiveParams *live;
+    const bool *stop;
+    int lastSeen;
+    size_t reads;
+    size_t mismatches;
+};
+
+static void *readLiveParams(void *arg) {
+    LiveReaderState &state = *static_cast<LiveReaderState *>(arg);
+    LiveParams::Reader reader(*state.live);
+    while (!__atomic_load_n(state.stop, __ATOMIC_ACQUIRE)) {
+        // Both options of a snapshot come from the same reload, and a
+        // reader never goes back to an older one.
+        const CmdLineParams &params = reader.get();
+        int first = params.getOpt("--first").asInt();
+        int second = params.getOpt("--second").asInt();
+        if (first != second || first < state.lastSeen) {
+            state.mismatches++;
+        }
+        state.lastSeen = first;
+        __atomic_store_n(&state.reads, state.reads + 1, __ATOMIC_RELEASE);
+        reader.quiescent();
+    }
+    return 0;
+}
+
+void Test__Parser__LiveParamsConcurrent() {
+    Pattern pattern;
+    PatternBuilder(pattern).opt("--first").opt("--second");
+
+    enum { Readers = 4, Reloads = 500 };
+    // Argv of every generation outlives the snapshots.
+    std::vector<str_t> tokens;
+    for (int i = 0; i <= Reloads; i++) {
+        std::ostringstream first, second;
+        first << "--first=" << i;
+        second << "--second=" << i;
+        tokens.push_back("/path/to/bin");
+        tokens.push_back(first.str());
+        tokens.push_back(second.str());
+    }
+    std::vector<char *> argv;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        argv.push_back(const_cast<char *>(tokens[i].c_str()));
+    }
+
+    LiveParams live(pattern, 3, &argv[0]);
+    bool stop = false;
+    LiveReaderState states[Readers];
+    pthread_t threads[Readers];
+    for (size_t i = 0; i < Readers; i++) {
+        LiveReaderState state = {&live, &stop, 0, 0, 0};
+        states[i] = state;
+        pthread_create(&threads[i], 0, readLiveParams, &states[i]);
+    }
+    for (size_t i = 0; i < Readers; i++) {
+        while (!__atomic_load_n(&states[i].reads, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+
+    for (int i = 1; i <= Reloads; i++) {
+        live.reload(3, &argv[3 * i]);
+        if (i % 16 == 0) {
+            sched_yield();
+        }
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < Readers; i++) {
+        pthread_join(threads[i], 0);
+        ASSERT_EQ(static_cast<size_t>(0), states[i].mismatches);
+        ASSERT(states[i].reads > 0);
+    }
+
+    // With no readers left, every retired snapshot is freed.
+    live.reload(3, &argv[3 * Reloads]);
+    ASSERT_EQ(static_cast<size_t>(0), live.pending());
+    LiveParams::Reader reader(live);
+    ASSERT_EQ(static_cast<int>(Reloads),
+              reader.get().getOpt("--first").asInt());
+}
+#endif
+
+void Test__Parser__Handles() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("arg0").arg()
+            .opt("-o").alias("--opt")
+            .opt("--unused")
+            .flag("-f").flag("-g");
+
+    ArgHandle arg0 = pattern.getArgHandle("arg0");
+    ArgHandle arg1 = pattern.getArgHandle(1);
+    OptHandle opt = pattern.getOptHandle("--opt");
+    OptHandle unused = pattern.getOptHandle("--unused");
+    FlagHandle f = pattern.getFlagHandle("-f");
+    FlagHandle g = pattern.getFlagHandle("-g");
+    ASSERT_THROWS(pattern.getOptHandle("--nope"), UnknownParamException);
+
+    const char *argv[] = {"/path/to/bin", "a", "-o", "val", "b", "-g"};
+    CmdLineParams params = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+    ASSERT_EQ(str_t("a"), params.get(arg0).asString());
+    ASSERT_EQ(str_t("b"), params.get(arg1).asString());
+    ASSERT(params.has(opt));
+    ASSERT_EQ(str_t("val"), params.get(opt).asString());
+    ASSERT(!params.has(unused));
+    ASSERT(!params.get(f));
+    ASSERT(params.get(g));
+}
+
+void Test__Parser__Snapshot() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("src").arg().defaultVal("out")
+            .opt("--mode").choices("fast|safe")
+            .opt("--note")
+            .flag("-v").flag("-q")
+            .rest("files");
+
+    const char *argv[] = {"/path/to/bin", "in", "--mode", "safe", "-q",
+                          "--", "dst", "a \"b\"", ""};
+    CmdLineParams params = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+
+    char json[256];
+    size_t jsonSize = params.writeJson(json, sizeof(json));
+    ASSERT_EQ(str_t("{\"args\":{\"src\":\"in\",\"1\":\"dst\"},"
+                    "\"flags\":{\"-v\":false,\"-q\":true},"
+                    "\"options\":{\"--mode\":\"safe\",\"--note\":null},"
+                    "\"rest\":[\"a \\\"b\\\"\",\"\"]}"),
+              str_t(json, jsonSize));
+    // Too short buffer: nothing past the capacity, same size returned.
+    char shortJson[8] = {0};
+    ASSERT_EQ(jsonSize, params.writeJson(shortJson, 4));
+    ASSERT_EQ(str_t("{\"ar"), str_t(shortJson));
+
+    size_t size = params.writeBinary(0, 0);
+    std::vector<char> buffer(size);
+    ASSERT_EQ(size, params.writeBinary(&buffer[0], buffer.size()));
+
+    CmdLineParams replayed(pattern);
+    replayed.readBinary(&buffer[0], buffer.size());
+    std::vector<char>().swap(buffer);
+    CmdLineParams copy(replayed);
+    ASSERT_EQ(str_t("in"), copy.getArg("src").asString());
+    ASSERT_EQ(str_t("dst"), copy.getArg(1).asString());
+    ASSERT_EQ(1, copy.getOpt("--mode").asChoice());
+    ASSERT(!copy.hasOpt("--note"));
+    ASSERT(!copy.hasFlag("-v"));
+    ASSERT(copy.hasFlag("-q"));
+    ASSERT_EQ(static_cast<size_t>(2), copy.getRest().size());
+    ASSERT_EQ(str_t("a \"b\""), str_t(copy.getRest()[0]));
+    ASSERT_EQ(str_t(""), str_t(copy.getRest()[1]));
+
+    char replayedJson[256];
+    ASSERT_EQ(jsonSize, copy.writeJson(replayedJson, sizeof(replayedJson)));
+    ASSERT_EQ(str_t(json, jsonSize), str_t(replayedJson, jsonSize));
+
+    char bad[] = "CPO";
+    ASSERT_THROWS(replayed.readBinary(bad, sizeof(bad)), Exception);
+    Pattern other;
+    PatternBuilder(other).flag("-v");
+    char otherSnapshot[64];
+    size = other.match(1, const_cast<char **>(argv))
+                .writeBinary(otherSnapshot, sizeof(otherSnapshot));
+    ASSERT_THROWS(replayed.readBinary(otherSnapshot, size), Exception);
+
+    // Every truncation fails and leaves the loaded values as they were.
+    size = params.writeBinary(0, 0);
+    buffer.resize(size);
+    params.writeBinary(&buffer[0], buffer.size());
+    CmdLineParams partial(pattern);
+    partial.readBinary(&buffer[0], buffer.size());
+    for (size_t length = 0; length < size; ++length) {
+        ASSERT_THROWS(partial.readBinary(&buffer[0], length), Exception);
+    }
+    ASSERT_EQ(str_t("in"), partial.getArg("src").asString());
+    ASSERT(partial.hasFlag("-q"));
+    ASSERT_EQ(static_cast<size_t>(2), partial.getRest().size());
+
+    // A choice id which doesn't match its value is rejected.
+    const char safe[] = "safe";
+    std::vector<char>::iterator value = std::search(
+            buffer.begin(), buffer.end(), safe, safe + 4);
+    ASSERT(value != buffer.end());
+    unsigned int wrongChoice = 0;
+    std::memcpy(&*value - 8, &wrongChoice, sizeof(wrongChoice));
+    ASSERT_THROWS(partial.readBinary(&buffer[0], buffer.size()), Exception);
+    ASSERT_EQ(1, partial.getOpt("--mode").asChoice());
+
+    // Params made before the pattern was extended load its new snapshots.
+    PatternBuilder(pattern).flag("--new").opt("--later");
+    const char *extended[] = {"/path/to/bin", "in", "--new", "--later=x"};
+    CmdLineParams current = pattern.match(
+            static_cast<int>(sizeOfArray(extended)),
+            const_cast<char **>(extended));
+    buffer.resize(current.writeBinary(0, 0));
+    current.writeBinary(&buffer[0], buffer.size());
+    partial.readBinary(&buffer[0], buffer.size());
+    ASSERT(partial.hasFlag("--new"));
+    ASSERT_EQ(str_t("x"), partial.getOpt("--later").asString());
+    ASSERT(!partial.hasFlag("-q"));
+    ASSERT(partial.getRest().empty());
+}
+
+void Test__Parser__MapSnapshot() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .opt("--set").alias("-D").map()
+            .opt("--label").map()
+            .opt("--env").map()
+            .opt("--mode");
+
+    const char *argv[] = {"/path/to/bin", "--set", "b=2", "-D", "a=1",
+                          "--mode=fast", "--label=tier=web", "--set=b=3",
+                          "--set", "empty="};
+    CmdLineParams params = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+    std::vector<char> buffer(params.writeBinary(0, 0));
+    params.writeBinary(&buffer[0], buffer.size());
+
+    CmdLineParams replayed(pattern);
+    replayed.readBinary(&buffer[0], buffer.size());
+    std::vector<char>().swap(buffer);
+    // Entries live in the params, copies point into their own storage.
+    CmdLineParams copy(pattern);
+    copy = replayed;
+    replayed = CmdLineParams(pattern);
+    ASSERT(copy.hasOpt("--set"));
+    const ParamMap &set = copy.getMap("--set");
+    ASSERT_EQ(static_cast<size_t>(3), set.size());
+    ASSERT_EQ(str_t("b"), str_t(set[0].key, set[0].keyLength));
+    ASSERT_EQ(str_t("3"), str_t(set[0].value));
+    ASSERT_EQ(str_t("a"), str_t(set[1].key, set[1].keyLength));
+    ASSERT_EQ(str_t("1"), set.get("a"));
+    ASSERT_EQ(str_t(""), set.get("empty"));
+    ASSERT_EQ(str_t("web"), copy.getMap("--label").get("tier"));
+    ASSERT(!copy.hasOpt("--env"));
+    ASSERT(copy.getMap("--env").empty());
+    ASSERT_EQ(str_t("fast"), copy.getOpt("--mode").asString());
+
+    char json[256];
+    char replayedJson[256];
+    size_t size = params.writeJson(json, sizeof(json));
+    ASSERT_EQ(size, copy.writeJson(replayedJson, sizeof(replayedJson)));
+    ASSERT_EQ(str_t(json, size), str_t(replayedJson, size));
+
+    // A match into loaded params points the maps into its argv again.
+    const char *argv2[] = {"/path/to/bin", "--label", "tier=db"};
+    pattern.match(3, const_cast<char **>(argv2), copy);
+    ASSERT(copy.getMap("--set").empty());
+    ASSERT_EQ(str_t("db"), copy.getMap("--label").get("tier"));
+}
+
+#ifdef CPPARSEOPT_STATS
+static int tracedPhases[PhaseCount];
+
+static void onPhaseBegin(TracePhase phase, void *context) {
+    ++static_cast<int *>(context)[phase];
+}
+
+static void onPhaseEnd(TracePhase phase, void *) {
+    ++tracedPhases[phase];
+}
+
+void Test__Parser__Stats() {
+    int begun[PhaseCount] = {0};
+    Instrumentation::reset();
+    Instrumentation::setTraceHooks(onPhaseBegin, onPhaseEnd, begun);
+
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("src")
+            .opt("--mode").choices("fast|safe")
+            .flag("-v");
+    ASSERT(begun[PhaseBuild] > 0);
+    ASSERT_EQ(0, begun[PhaseMatch]);
+
+    const char *argv[] = {"/path/to/bin", "in", "--mode", "safe", "-v"};
+    pattern.match(static_cast<int>(sizeOfArray(argv)),
+                  const_cast<char **>(argv));
+    const char *bad[] = {"/path/to/bin", "in", "--mode", "slow"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(bad)),
+                                const_cast<char **>(bad)),
+                  BadValueException);
+    Instrumentation::setTraceHooks(0, 0);
+
+    const ParseStats &stats = Instrumentation::stats();
+    ASSERT_EQ(2ul, stats.matches);
+    ASSERT_EQ(7ul, stats.tokens);
+    ASSERT(stats.lookups > 0);
+    ASSERT(stats.probes >= stats.lookups);
+    ASSERT(stats.allocations > 0);
+    ASSERT_EQ(1ul, stats.exceptions);
+    ASSERT(stats.matchNs >= stats.classifyNs);
+    ASSERT_EQ(2, begun[PhaseMatch]);
+    ASSERT_EQ(2, begun[PhaseClassify]);
+    ASSERT_EQ(2, begun[PhaseConvert]);
+    for (int phase = 0; phase < PhaseCount; ++phase) {
+        ASSERT_EQ(begun[phase], tracedPhases[phase]);
+    }
+}
+#endif
+
+void Test__Parser__Copies() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("src")
+            .opt("--mode")
+            .rest("files");
+
+    const char *argv[] = {"/path/to/bin", "in", "--mode", "fast", "a", "b"};
+    CmdLineParams parsed = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+    std::vector<char> snapshot(parsed.writeBinary(0, 0));
+    parsed.writeBinary(&snapshot[0], snapshot.size());
+    CmdLineParams loaded(pattern);
+    loaded.readBinary(&snapshot[0], snapshot.size());
+
+    // Copies and swaps keep loaded rest args pointing into own storage.
+    CmdLineParams copy(pattern);
+    copy = loaded;
+    CmdLineParams swapped(pattern);
+    swapped.swap(copy);
+    loaded = CmdLineParams(pattern);
+    ASSERT_EQ(str_t("in"), swapped.getArg("src").asString());
+    ASSERT_EQ(str_t("fast"), swapped.getOpt("--mode").asString());
+    ASSERT_EQ(static_cast<size_t>(2), swapped.getRest().size());
+    ASSERT_EQ(str_t("b"), str_t(swapped.getRest()[1]));
+    ASSERT_EQ(static_cast<size_t>(0), copy.getRest().size());
+    ASSERT_EQ(static_cast<size_t>(0), loaded.getRest().size());
+
+#ifdef CPPARSEOPT_MOVE
+    CmdLineParams moved(std::move(swapped));
+    ASSERT_EQ(str_t("a"), str_t(moved.getRest()[0]));
+    ASSERT_EQ(str_t("in"), moved.getArg("src").asString());
+
+    Pattern movedPattern(std::move(pattern));
+    ASSERT(!pattern.hasOpt("--mode"));
+    ASSERT(!pattern.hasRest());
+    ASSERT(movedPattern.hasOpt("--mode"));
+    CmdLineParams params = movedPattern.match(
+            static_cast<int>(sizeOfArray(argv)), const_cast<char **>(argv));
+    ASSERT_EQ(str_t("fast"), params.getOpt("--mode").asString());
+    pattern = std::move(movedPattern);
+    ASSERT(pattern.hasRest());
+#endif
+}
+
+void Test__Parser__PatternCopies() {
+    int level = 0;
+    bool verbose = false;
+    Pattern *original = new Pattern;
+    PatternBuilder(*original)
+            .arg("src").descr("Source")
+            .opt("--level").alias("-l").bindTo(&level).defaultVal(3)
+                           .descr("Level")
+            .opt("--mode").choices("fast|safe")
+            .flag("-v").bindTo(&verbose).descr("Verbose");
+
+    // Param records hold no pointers: the copy reads its own pool.
+    Pattern copy(*original);
+    delete original;
+    PatternBuilder(copy).opt("--added").descr("Added after the copy");
+    ASSERT_EQ(str_t("src"), str_t(copy.getName(copy.getArg(0))));
+    ASSERT_EQ(str_t("Source"), copy.getDescr(copy.getArg("src")));
+    ASSERT_EQ(str_t("--level"), str_t(copy.getName(copy.getOpt("-l"))));
+    ASSERT_EQ(str_t("Level"), copy.getDescr(copy.getOpt("--level")));
+    ASSERT_EQ(str_t("3"), copy.getDefault(copy.getOpt("--level")));
+    ASSERT_EQ(1, copy.findChoice(copy.getOpt("--mode"), "safe"));
+    ASSERT_EQ(str_t("Verbose"), copy.getDescr(copy.getFlag("-v")));
+    ASSERT_EQ(str_t("Added after the copy"),
+              copy.getDescr(copy.getOpt("--added")));
+
+    const char *argv[] = {"/path/to/bin", "in", "-l", "-v", "--mode=safe"};
+    CmdLineParams params = copy.match(static_cast<int>(sizeOfArray(argv)),
+                                      const_cast<char **>(argv));
+    ASSERT_EQ(3, level);
+    ASSERT(verbose);
+    ASSERT_EQ(1, params.getOpt("--mode").asChoice());
+}
+
+void Test__Parser__Constraints() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .opt("--tls-key").opt("--tls-cert")
+            .flag("-q").flag("-v").flag("--debug")
+            .flag("--json").flag("--yaml")
+            .opt("--input").flag("--stdin")
+            .dependsOn("--tls-key", "--tls-cert")
+            .conflicts("-q", "-v|--debug")
+            .exclusive("--json|--yaml")
+            .atLeastOne("--input|--stdin");
+    ASSERT_THROWS(PatternBuilder(pattern).exclusive("--json|--nope"),
+                  UnknownParamException);
+
+    const char *ok[] = {"/path/to/bin", "--tls-key", "k", "--tls-cert", "c",
+                        "-q", "--yaml", "--stdin"};
+    ASSERT_NOTHROW(pattern.match(static_cast<int>(sizeOfArray(ok)),
+                                 const_cast<char **>(ok)),
+                   Exception);
+
+    const char *noCert[] = {"/path/to/bin", "--tls-key", "k", "--stdin"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(noCert)),
+                                const_cast<char **>(noCert)),
+                  MissingParamException);
+    const char *quietVerbose[] = {"/path/to/bin", "--debug", "-q", "--stdin"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(quietVerbose)),
+                                const_cast<char **>(quietVerbose)),
+                  ConflictingParamsException);
+    const char *verbose[] = {"/path/to/bin", "-v", "--debug", "--stdin"};
+    ASSERT_NOTHROW(pattern.match(static_cast<int>(sizeOfArray(verbose)),
+                                 const_cast<char **>(verbose)),
+                   Exception);
+    const char *formats[] = {"/path/to/bin", "--json", "--stdin", "--yaml"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(formats)),
+                                const_cast<char **>(formats)),
+                  ConflictingParamsException);
+    const char *noInput[] = {"/path/to/bin", "--json"};
+    ASSERT_THROWS(pattern.match(static_cast<int>(sizeOfArray(noInput)),
+                                const_cast<char **>(noInput)),
+                  MissingParamException);
+
+    // Ordinals past the first presence word.
+    Pattern wide;
+    std::vector<str_t> names;
+    for (char c = 'a'; c <= 'z'; ++c) {
+        for (char d = 'a'; d <= 'e'; ++d) {
+            names.push_back(str_t("--") + c + d);
+            PatternBuilder(wide).flag(names.back());
+        }
+    }
+    PatternBuilder(wide)
+            .exclusive(names[1] + "|" + names[70] + "|" + names[129])
+            .dependsOn(names[0], names[64] + "|" + names[128]);
+    const char *wideOk[] = {"/path/to/bin", "--ab", "--aa", "--me", "--zd"};
+    ASSERT_EQ(names[64], str_t("--me"));
+    ASSERT_EQ(names[128], str_t("--zd"));
+    ASSERT_NOTHROW(wide.match(static_cast<int>(sizeOfArray(wideOk)),
+                              const_cast<char **>(wideOk)),
+                   Exception);
+    const char *wideBad[] = {"/path/to/bin", "--ab", "--ze"};
+    ASSERT_EQ(names[129], str_t("--ze"));
+    ASSERT_THROWS(wide.match(static_cast<int>(sizeOfArray(wideBad)),
+                             const_cast<char **>(wideBad)),
+                  ConflictingParamsException);
+    Pattern copy(wide);
+    const char *wideMissing[] = {"/path/to/bin", "--aa", "--me"};
+    ASSERT_THROWS(copy.match(static_cast<int>(sizeOfArray(wideMissing)),
+                             const_cast<char **>(wideMissing)),
+                  MissingParamException);
+}
+
+void Test__Parser__SplitLine() {
+    char line[] = "  cmd plain\t'single quoted' \"double \\\"q\\\" \\$x \\y\" "
+                  "es\\ caped con\\\ntinued '' a'b'\"c\" \\\n \"\\\\\" "
+                  "'it'\\''s' ";
+    char *argv[16];
+    size_t count = Pattern::splitLine(line, argv, 16);
+    const char *expected[] = {"cmd", "plain", "single quoted",
+                              "double \"q\" $x \\y", "es caped", "continued",
+                              "", "abc", "\\", "it's"};
+    ASSERT_EQ(sizeOfArray(expected), count);
+    for (size_t i = 0; i < count && i < sizeOfArray(expected); ++i) {
+        ASSERT_EQ(str_t(expected[i]), str_t(argv[i]));
+    }
+
+    char few[] = "a b c d";
+    ASSERT_EQ(static_cast<size_t>(4), Pattern::splitLine(few, argv, 2));
+    ASSERT_EQ(str_t("b"), str_t(argv[1]));
+    char blank[] = " \t\\\n ";
+    ASSERT_EQ(static_cast<size_t>(0), Pattern::splitLine(blank, argv, 16));
+    char unterminated[] = "a 'b";
+    ASSERT_THROWS(Pattern::splitLine(unterminated, argv, 16),
+                  BadValueException);
+
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .arg("service")
+            .opt("--timeout")
+            .flag("--graceful");
+    char command[] = "restart --graceful --timeout=30 'my service'";
+    CmdLineParams params = pattern.matchLine(command, argv, 16);
+    ASSERT_EQ(str_t("my service"), params.getArg("service").asString());
+    ASSERT_EQ(30, params.getOpt("--timeout").asInt());
+    ASSERT(params.hasFlag("--graceful"));
+    char tooLong[] = "restart a b c";
+    ASSERT_THROWS(pattern.matchLine(tooLong, argv, 3), Exception);
+}
+
+void Test__Parser__Namespaces() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .opt("--db.pool.timeout").defaultVal("30")
+            .opt("--cache.shard.count")
+            .opt("--db.poolx")
+            .opt("--db.pool.size").alias("-s")
+            .opt("--db.host")
+            .flag("-v");
+
+    const char *argv[] = {"/path/to/bin", "--db.pool.size=10", "-v",
+                          "--db.host", "localhost", "--cache.shard.count=4"};
+    CmdLineParams params = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+    ASSERT_EQ(10, params.getOpt("-s").asInt());
+
+    ParamGroup pool = params.group("--db.pool");
+    ASSERT_EQ(static_cast<size_t>(2), pool.size());
+    ASSERT_EQ(str_t("--db.pool.size"), str_t(pool.getName(0)));
+    ASSERT_EQ(str_t("--db.pool.timeout"), str_t(pool.getName(1)));
+    ASSERT(pool.has(0));
+    ASSERT_EQ(str_t("10"), pool.get(0).asString());
+    ASSERT(!pool.has(1));
+    ASSERT_EQ(static_cast<size_t>(2), params.group("--db.pool.").size());
+
+    ParamGroup db = params.group("--db");
+    ASSERT_EQ(static_cast<size_t>(4), db.size());
+    ASSERT_EQ(str_t("--db.host"), str_t(db.getName(0)));
+    ASSERT_EQ(str_t("localhost"), db.get(0).asString());
+    ASSERT_EQ(str_t("--db.poolx"), str_t(db.getName(3)));
+    ASSERT_EQ(str_t("4"), params.group("--cache.shard").get(0).asString());
+    ASSERT(params.group("--cache.shard.count").empty());
+    ASSERT(params.group("--nope").empty());
+
+    Pattern copy(pattern);
+    CmdLineParams copyParams = copy.match(1, const_cast<char **>(argv));
+    ASSERT_EQ(static_cast<size_t>(4), copyParams.group("--db").size());
+}
+
+void Test__Parser__MapOptions() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .opt("--set").alias("-D").map()
+            .opt("--label").map(Option::FirstWins)
+            .opt("--env").map(Option::RejectDuplicates)
+            .opt("--mode").choices("fast|safe")
+            .flag("-v");
+
+    const char *argv[] = {"/path/to/bin", "--set", "b=2", "-D", "a=1",
+                          "--set=b=3", "--label", "tier=web", "-v",
+                          "--label=tier=db", "--set", "url=http://x/?q=1",
+                          "--set=empty="};
+    int argc = static_cast<int>(sizeOfArray(argv));
+    CmdLineParams params = pattern.match(argc, const_cast<char **>(argv));
+    ASSERT(params.hasOpt("--set"));
+    ASSERT(params.hasFlag("-v"));
+
+    const ParamMap &set = params.getMap("-D");
+    ASSERT_EQ(static_cast<size_t>(4), set.size());
+    // The first occurrence of a key defines its place, the last its value.
+    ASSERT_EQ(str_t("b"), str_t(set[0].key, set[0].keyLength));
+    ASSERT_EQ(str_t("3"), str_t(set[0].value));
+    ASSERT_EQ(str_t("a"), str_t(set[1].key, set[1].keyLength));
+    ASSERT_EQ(str_t("http://x/?q=1"), set.get("url"));
+    ASSERT_EQ(str_t(""), set.get("empty"));
+    ASSERT(set.has("a"));
+    ASSERT(!set.has("c"));
+    ASSERT(0 == set.find("ur", 2));
+    ASSERT_THROWS(set.get("c"), MissingParamException);
+    ASSERT_EQ(str_t("tier=web"), str_t(argv[7]));
+
+    const ParamMap &label = params.getMap(pattern.getOptHandle("--label"));
+    ASSERT_EQ(static_cast<size_t>(1), label.size());
+    ASSERT_EQ(str_t("web"), label.get("tier"));
+    ASSERT(!params.hasOpt("--env"));
+    ASSERT(params.getMap("--env").empty());
+    ASSERT_THROWS(params.getMap("--mode"), UnknownParamException);
+
+    // Many keys: the table grows, lookups stay exact.
+    std::vector<str_t> items;
+    for (int i = 0; i < 1000; i++) {
+        std::ostringstream item;
+        item << "key" << i << "=" << i * 3;
+        items.push_back(item.str());
+    }
+    std::vector<const char *> many(1, "/path/to/bin");
+    for (size_t i = 0; i < items.size(); i++) {
+        many.push_back("--env");
+        many.push_back(items[i].c_str());
+    }
+    pattern.match(static_cast<int>(many.size()),
+                  const_cast<char **>(&many[0]), params);
+    const ParamMap &env = params.getMap("--env");
+    ASSERT_EQ(static_cast<size_t>(1000), env.size());
+    ASSERT_EQ(str_t("2997"), env.get("key999"));
+    ASSERT_EQ(str_t("key500"), str_t(env[500].key, env[500].keyLength));
+    ASSERT(params.getMap("--set").empty());
+
+    CmdLineParams copy(params);
+    ASSERT_EQ(str_t("42"), copy.getMap("--env").get("key14"));
+
+    const char *dup[] = {"/path/to/bin", "--env", "a=1", "--env=a=2"};
+    ASSERT_THROWS(pattern.match(4, const_cast<char **>(dup)),
+                  BadValueException);
+    const char *noKey[] = {"/path/to/bin", "--set", "=1"};
+    ASSERT_THROWS(pattern.match(3, const_cast<char **>(noKey)),
+                  BadValueException);
+    const char *noEq[] = {"/path/to/bin", "--set", "a"};
+    ASSERT_THROWS(pattern.match(3, const_cast<char **>(noEq)),
+                  BadValueException);
+    const char *noValue[] = {"/path/to/bin", "--set"};
+    ASSERT_THROWS(pattern.match(2, const_cast<char **>(noValue)),
+                  MissingParamException);
+
+    const char *json[] = {"/path/to/bin", "--set", "k=\"v\""};
+    pattern.match(3, const_cast<char **>(json), params);
+    char buf[256];
+    size_t size = params.writeJson(buf, sizeof(buf));
+    ASSERT(str_t(buf, size).find("\"--set\":{\"k\":\"\\\"v\\\"\"}")
+           != str_t::npos);
+
+    Pattern bad;
+    str_t target;
+    ASSERT_THROWS(PatternBuilder(bad).opt("--aa").bindTo(&target).map(),
+                  BadValueException);
+    ASSERT_THROWS(PatternBuilder(bad).opt("--dd").choices("x|y").map(),
+                  BadValueException);
+    ASSERT_THROWS(PatternBuilder(bad).opt("--bb").map().choices("x|y"),
+                  BadValueException);
+    ASSERT_THROWS(PatternBuilder(bad).opt("--cc").map().defaultVal("x=1"),
+                  BadValueException);
+}
+
+void Test__Parser__PatternExtension() {
+    Pattern pattern;
+    PatternBuilder(pattern)
+            .opt("--core.jobs").defaultVal("1")
+            .opt("--core.define").alias("-D").map()
+            .flag("-v");
+    const Option &jobs = pattern.getOpt("--core.jobs");
+    OptHandle jobsHandle = pattern.getOptHandle("--core.jobs");
+    FlagHandle verbose = pattern.getFlagHandle("-v");
+
+    const char *argv[] = {"/path/to/bin", "--core.jobs=2", "-v"};
+    CmdLineParams before = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+
+    // A plugin adds its params to the pattern already in use.
+    static const ParamDescr plugin[] = {
+        {ParamDescr::OptParam,  "--zip.level|-z", "6", 0},
+        {ParamDescr::FlagParam, "--zip.fast", 0, 0},
+        {ParamDescr::OptParam,  "--core.cache", 0, 0},
+    };
+    PatternBuilder(pattern)
+            .table(plugin)
+            .opt("--zip.env").map()
+            .flag("-q");
+    ASSERT_EQ(str_t("1"), pattern.getDefault(jobs));
+    ASSERT(&jobs == &pattern.getOpt("--core.jobs"));
+    ASSERT_EQ(str_t("6"), pattern.getDefault(pattern.getOpt("-z")));
+    ASSERT(pattern.hasFlag("--zip.fast"));
+    // A clashing name stays with the param that had it first.
+    PatternBuilder(pattern).opt("-D");
+    ASSERT_EQ(str_t("--core.define"),
+              str_t(pattern.getName(pattern.getOpt("-D"))));
+
+    // Params matched before the extension see the new ones as absent.
+    ASSERT_EQ(2, before.get(jobsHandle).asInt());
+    ASSERT(before.get(verbose));
+    OptHandle level = pattern.getOptHandle("--zip.level");
+    ASSERT(!before.has(level));
+    ASSERT_EQ(str_t(""), before.get(level).asString());
+    ASSERT(!before.get(pattern.getFlagHandle("-q")));
+    ASSERT(before.getMap(pattern.getOptHandle("--zip.env")).empty());
+    ParamGroup old = before.group("--core");
+    ASSERT_EQ(static_cast<size_t>(3), old.size());
+    ASSERT(!old.has(0));
+    ASSERT_EQ(str_t(""), old.get(0).asString());
+    ASSERT(old.has(2));
+    ASSERT_EQ(str_t("2"), old.get(2).asString());
+    ParamGroup zip = before.group("--zip");
+    ASSERT_EQ(static_cast<size_t>(2), zip.size());
+    ASSERT(!zip.has(1));
+    ASSERT_EQ(str_t(""), zip.get(1).asString());
+
+    const char *more[] = {"/path/to/bin", "--zip.level=9", "--zip.env", "a=1",
+                          "-D", "b=2", "--core.cache=/tmp", "-q"};
+    CmdLineParams after = pattern.match(static_cast<int>(sizeOfArray(more)),
+                                        const_cast<char **>(more));
+    ASSERT_EQ(9, after.getOpt("--zip.level").asInt());
+    ASSERT_EQ(str_t("1"), after.getMap("--zip.env").get("a"));
+    ASSERT_EQ(str_t("2"), after.getMap("--core.define").get("b"));
+    ASSERT(!after.has(jobsHandle));
+    ASSERT(after.hasFlag("-q"));
+    ParamGroup core = after.group("--core");
+    ASSERT_EQ(static_cast<size_t>(3), core.size());
+    ASSERT_EQ(str_t("--core.cache"), str_t(core.getName(0)));
+    ASSERT_EQ(str_t("/tmp"), core.get(0).asString());
+    ASSERT_EQ(static_cast<size_t>(2), after.group("--zip").size());
+
+    // Many plugins: every name stays reachable.
+    for (int p = 0; p < 40; p++) {
+        PatternBuilder builder(pattern);
+        for (int i = 0; i < 30; i++) {
+            std::ostringstream name;
+            name << "--plugin-" << (p * 7) % 40 << ".option-" << i;
+            builder.opt(name.str().c_str())
+                   .alias((name.str() + "-alias").c_str());
+        }
+    }
+    ASSERT_EQ(str_t("--plugin-7.option-29"),
+              str_t(pattern.getName(
+                      pattern.getOpt("--plugin-7.option-29-alias"))));
+    ASSERT(!pattern.hasOpt("--plugin-40.option-0"));
+    ASSERT(&jobs == &pattern.getOpt("--core.jobs"));
+    const char *plugged[] = {"/path/to/bin", "--plugin-39.option-0-alias=x"};
+    after = pattern.match(2, const_cast<char **>(plugged));
+    ASSERT_EQ(str_t("x"), after.getOpt("--plugin-39.option-0").asString());
+    ASSERT_EQ(static_cast<size_t>(30),
+              after.group("--plugin-39").size());
+
+    Pattern copy(pattern);
+    ASSERT(copy.hasOpt("--plugin-0.option-0-alias"));
+    ASSERT(!(&copy.getOpt("--core.jobs") == &jobs));
+    PatternBuilder(copy).flag("--copy-only");
+    ASSERT(!pattern.hasFlag("--copy-only"));
+    ASSERT(copy.hasFlag("--copy-only"));
+}
+
+void Test__Parser__PatternExtensionArgs() {
+    Pattern pattern;
+    PatternBuilder(pattern).arg("input");
+    const char *argv[] = {"/path/to/bin", "in.txt"};
+    CmdLineParams before = pattern.match(static_cast<int>(sizeOfArray(argv)),
+                                         const_cast<char **>(argv));
+
+    PatternBuilder(pattern).arg("output").defaultVal("out.txt");
+    ASSERT_EQ(str_t("in.txt"), before.getArg("input").asString());
+    ASSERT_EQ(str_t(""), before.getArg("output").asString());
+    ASSERT_EQ(str_t(""), before.getArg(1).asString());
+    ASSERT_THROWS(before.getArg(2), UnknownParamException);
+}
+
 void TestSuite__Parser() {
     std::cout << "Test Suite: Parser" << std::endl;
 
     Test__Parser__SimpleArgs();
     Test__Parser__SimpleFlags();
+    Test__Parser__Binding();
+    Test__Parser__StructBinding();
+    Test__Parser__StructBindingFields();
+    Test__Parser__TokenClassification();
+    Test__Parser__Choices();
+    Test__Parser__BoundChoices();
+    Test__Parser__TypedDefaults();
+    Test__Parser__RestArgs();
+    Test__Parser__ManyRestArgs();
+    Test__Parser__RegisteredOptions();
+    Test__Parser__Handles();
+    Test__Parser__Snapshot();
+    Test__Parser__MapSnapshot();
+    Test__Parser__Copies();
+    Test__Parser__PatternCopies();
+    Test__Parser__Constraints();
+    Test__Parser__SplitLine();
+    Test__Parser__Namespaces();
+    Test__Parser__MapOptions();
+    Test__Parser__PatternExtension();
+    Test__Parser__PatternExtensionArgs();
+#ifdef __GNUC__
+    Test__Parser__LiveParams();
+    Test__Parser__LiveParamsConcurrent();
+#endif
+#ifdef CPPARSEOPT_STATS
+    Test__Parser__Stats();
+#endif
     //Test__Parser__SimpleOptions();
 
     std::cout << std::endl;
@@ -199,4 +1504,6 @@ int main(int argc, char *argv[]) {
     std::cout << std::endl;
 
     TestSuite__Parser();
+
+    return failures ? 1 : 0;
 }
\ No newline at end of file